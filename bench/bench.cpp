@@ -0,0 +1,270 @@
+/******************************************************
+**
+** Microbenchmarks for the Torpedo codec.
+**
+** Each case drives an output port into an input port
+** through a sample buffer, up to 256 samples at a time,
+** timing the encode side (send and output processing)
+** and the decode side (input processing and received
+** callbacks) apart.
+**
+** 	ns/sample	time per sample on each side
+**	msgs/s		messages per second of codec time
+**	allocs/msg	heap allocations per message, including
+**			those made by jansson
+**
+** Usage: bench [blockSize]
+**
+** With a block size of 1 (the default) the ports are
+** driven one sample at a time through process(), as a
+** module's step() would. Larger sizes use processBlock().
+**
+*******************************************************/
+
+#include "rack.hpp"
+#include "torpedo.hpp"
+#include <chrono>
+#include <new>
+
+using namespace rack;
+
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+	allocations++;
+	void *p = malloc(size);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+static void *countedMalloc(size_t size) {
+	allocations++;
+	return malloc(size);
+}
+
+struct BenchModule : Module {
+	BenchModule() : Module(0, 1, 1, 0) {}
+};
+
+struct CountingInputPort : Torpedo::RawInputPort {
+	unsigned long count = 0;
+	CountingInputPort(Module *module, unsigned int portNum) : Torpedo::RawInputPort(module, portNum) {}
+	void received(const std::string &appId, const std::string &message) override { count++; }
+};
+
+struct StreamingInputPort : Torpedo::RawInputPort {
+	unsigned long count = 0;
+	unsigned long bytes = 0;
+	StreamingInputPort(Module *module, unsigned int portNum) : Torpedo::RawInputPort(module, portNum) { stream(4096); }
+	void onChunk(const char *chunk, unsigned int length) override { bytes += length; }
+	void onEnd(int ok) override { count++; }
+};
+
+struct CountingMessageInputPort : Torpedo::MessageInputPort {
+	unsigned long count = 0;
+	CountingMessageInputPort(Module *module, unsigned int portNum) : Torpedo::MessageInputPort(module, portNum) {}
+	void received(const std::string &pluginName, const std::string &moduleName, const std::string &message) override { count++; }
+};
+
+struct CountingPatchInputPort : Torpedo::PatchInputPort {
+	unsigned long count = 0;
+	unsigned int reject = 0;
+	CountingPatchInputPort(Module *module, unsigned int portNum) : Torpedo::PatchInputPort(module, portNum) {}
+	int accept(const std::string &pluginName, const std::string &moduleName) override { return !reject; }
+	void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) override { count++; }
+};
+
+static const unsigned long targetSamples = 2000000;
+static unsigned int blockSize = 1;
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed(Clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static std::string sizeName(unsigned int size) {
+	char text[20];
+	if (size >= 1048576)
+		snprintf(text, sizeof(text), "%u MB", size / 1048576);
+	else if (size >= 1024)
+		snprintf(text, sizeof(text), "%u KB", size / 1024);
+	else
+		snprintf(text, sizeof(text), "%u B", size);
+	return std::string(text);
+}
+
+//
+// Send a burst of messages with the given function and clock both ports
+// until the output port is idle, repeating until enough samples have
+// passed to give a stable figure.
+//
+
+template <typename SEND>
+static void measure(const char *name, unsigned int size, BenchModule &module, Torpedo::RawOutputPort &out, Torpedo::RawInputPort &in, unsigned int burst, SEND send) {
+	unsigned int chunk = ((255 + blockSize) / blockSize) * blockSize;
+	std::vector<float> samples(chunk);
+	unsigned long sampleCount = 0;
+	unsigned long messages = 0;
+	unsigned long allocs = 0;
+	double encode = 0.0;
+	double decode = 0.0;
+	while (sampleCount < targetSamples) {
+		unsigned long start = allocations;
+		Clock::time_point t = Clock::now();
+		for (unsigned int i = 0; i < burst; i++)
+			send();
+		encode += elapsed(t);
+		while (out.isBusy()) {
+			unsigned int count = 0;
+			t = Clock::now();
+			while ((count < chunk) && out.isBusy()) {
+				if (blockSize == 1) {
+					out.process();
+					samples[count] = module.outputs[0].value;
+				}
+				else {
+					out.processBlock(samples.data() + count, blockSize);
+				}
+				count += blockSize;
+			}
+			encode += elapsed(t);
+			t = Clock::now();
+			if (blockSize == 1) {
+				for (unsigned int i = 0; i < count; i++) {
+					module.inputs[0].value = samples[i];
+					in.process();
+				}
+			}
+			else {
+				in.processBlock(samples.data(), count);
+			}
+			decode += elapsed(t);
+			sampleCount += count;
+		}
+		allocs += allocations - start;
+		messages += burst;
+	}
+	printf("%-24s %7s %10.2f %10.2f %12.0f %10.1f\n", name, sizeName(size).c_str(),
+		encode / sampleCount, decode / sampleCount,
+		messages / ((encode + decode) * 1e-9), 1.0 * allocs / messages);
+}
+
+static std::string payload(unsigned int size) {
+	std::string text;
+	text.reserve(size);
+	for (unsigned int i = 0; i < size; i++)
+		text.push_back('a' + (i * 7) % 26);
+	return text;
+}
+
+static json_t *patch(unsigned int size) {
+	json_t *rootJ = json_object();
+	json_t *params = json_array();
+	for (unsigned int i = 0; i < size / 20; i++)
+		json_array_append_new(params, json_real(i * 0.0123456789));
+	json_object_set_new(rootJ, "params", params);
+	return rootJ;
+}
+
+static void rawCase(const char *name, unsigned int size, unsigned int wide, unsigned int compact) {
+	BenchModule module;
+	Torpedo::RawOutputPort out(&module, 0);
+	CountingInputPort in(&module, 0);
+	std::string message = payload(size);
+	out.wide(wide);
+	out.compact(compact);
+	measure(name, size, module, out, in, 1, [&]() {
+		out.send("BNCH", message);
+	});
+}
+
+static void streamedCase(const char *name, unsigned int size) {
+	BenchModule module;
+	Torpedo::RawOutputPort out(&module, 0);
+	StreamingInputPort in(&module, 0);
+	std::string message = payload(size);
+	out.wide(1);
+	measure(name, size, module, out, in, 1, [&]() {
+		out.send("BNCH", message);
+	});
+}
+
+static void queuedCase(const char *name, unsigned int size, unsigned int batch) {
+	BenchModule module;
+	Torpedo::QueuedOutputPort out(&module, 0);
+	CountingInputPort in(&module, 0);
+	std::string message = payload(size);
+	out.appId("BNCH");
+	out.size(16);
+	out.batch(batch);
+	measure(name, size, module, out, in, 16, [&]() {
+		out.send(message);
+	});
+}
+
+static void messageCase(const char *name, unsigned int size, unsigned int binary) {
+	BenchModule module;
+	Torpedo::MessageOutputPort out(&module, 0);
+	CountingMessageInputPort in(&module, 0);
+	std::string message = payload(size);
+	out.size(1);
+	out.binary(binary);
+	measure(name, size, module, out, in, 1, [&]() {
+		out.send("TorpedoBench", "Bench", message);
+	});
+}
+
+static void patchCase(const char *name, unsigned int size, unsigned int compress, unsigned int binary, unsigned int reject) {
+	BenchModule module;
+	Torpedo::PatchOutputPort out(&module, 0);
+	CountingPatchInputPort in(&module, 0);
+	in.reject = reject;
+	out.size(1);
+	out.compress(compress);
+	out.binary(binary);
+	measure(name, size, module, out, in, 1, [&]() {
+		out.send("TorpedoBench", "Bench", patch(size));
+	});
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1)
+		blockSize = std::max(1, atoi(argv[1]));
+	json_set_alloc_funcs(countedMalloc, free);
+
+	static const unsigned int sizes[] = { 4, 64, 1024, 16384, 262144, 1048576 };
+
+	printf("block size %u\n", blockSize);
+	printf("%-24s %7s %10s %10s %12s %10s\n", "case", "size", "enc ns/smp", "dec ns/smp", "msgs/s", "allocs/msg");
+	for (unsigned int size : sizes)
+		rawCase("raw", size, 0, 0);
+	for (unsigned int size : sizes)
+		rawCase("raw wide", size, 1, 0);
+	for (unsigned int size : sizes)
+		rawCase("raw compact", size, 0, 1);
+	for (unsigned int size : sizes)
+		streamedCase("raw wide streamed", size);
+	for (unsigned int size : sizes)
+		queuedCase("queued x16", size, 0);
+	for (unsigned int size : sizes)
+		queuedCase("queued x16 batched", size, 4096);
+	for (unsigned int size : sizes)
+		messageCase("MESG", size, 0);
+	for (unsigned int size : sizes)
+		messageCase("MESG binary", size, 1);
+	for (unsigned int size : sizes)
+		patchCase("PTCH", size, 0, 0, 0);
+	for (unsigned int size : sizes)
+		patchCase("PTCH rejected", size, 0, 0, 1);
+	for (unsigned int size : sizes)
+		patchCase("PTCH compressed", size, 1, 0, 0);
+	for (unsigned int size : sizes)
+		patchCase("PTCH binary", size, 0, 1, 0);
+	return 0;
+}
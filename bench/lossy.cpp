@@ -0,0 +1,153 @@
+/******************************************************
+**
+** Lossy link check for Torpedo reliable links.
+**
+** Joins a ReliableOutputPort and a ReliableInputPort
+** with a pair of simulated cables that flip bits in
+** the samples passing through them, and checks that
+** every message is delivered once and in order and
+** that the sender goes idle.
+**
+**	damage	one sample of the first frame of an epoch
+**		is damaged, for each step from 1 to 60,
+**		and again after an abort()
+**	noise	random bit flips on both cables for a
+**		range of seeds and error rates
+**
+** The frame checksum is a running sum, so now and then
+** two flips in one frame cancel out and a damaged frame
+** is taken as good. The reliable layer cannot see those
+** escapes, and a damaged length or sequence number can
+** lose a message, so the receiver checks each segment
+** against those sent and links with an escape are only
+** counted.
+**
+** Usage: lossy
+**
+** Exits non-zero if a link without an escape loses,
+** duplicates, reorders or damages a message, or a link
+** never drains.
+**
+*******************************************************/
+
+#include "rack.hpp"
+#include "torpedo.hpp"
+#include <random>
+#include <set>
+
+using namespace rack;
+
+static const unsigned int maxSteps = 2000000;
+
+struct Link : Module {
+	struct InPort : Torpedo::ReliableInputPort {
+		std::vector<std::string> messages;
+		std::set<std::string> *segments;
+		unsigned int escapes = 0;
+		InPort(Module *module, std::set<std::string> *s) : Torpedo::ReliableInputPort(module, 0, 1) { segments = s; }
+		void received(const std::string &appId, const std::string &message) override {
+			messages.push_back(message);
+		}
+		void sequenced() override {
+			if (!segments->count(_message))
+				escapes++;
+			Torpedo::ReliableInputPort::sequenced();
+		}
+	};
+
+	std::set<std::string> segments;
+
+	Torpedo::ReliableOutputPort outPort;
+	InPort inPort;
+	std::vector<std::string> sent;
+	std::mt19937 rng;
+	double noise = 0.0;
+	unsigned int damageAt = 0;
+	unsigned int steps = 0;
+
+	Link(unsigned int seed) : Module(0, 2, 2, 0), outPort(this, 0, 1), inPort(this, &segments), rng(seed) {
+		outPort.appId("RELY");
+		outPort.size(100);
+	}
+
+	void send(const std::string &message) {
+		sent.push_back(message);
+		outPort.send(message);
+	}
+
+	// Step until the sender is idle, passing the cables through the noise
+	int run() {
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		for (steps = 1; outPort.isBusy() && (steps < maxSteps); steps++) {
+			outPort.process();
+			for (auto &segment : outPort._window)
+				segments.insert(segment._body);
+			inPort.process();
+			for (unsigned int p = 0; p < 2; p++) {
+				unsigned int sample = (unsigned int)outputs[p].value;
+				if (!p && (steps == damageAt))
+					sample ^= 0x10000;
+				if ((noise > 0.0) && (uniform(rng) < noise))
+					sample ^= 1 << (rng() % 16);
+				inputs[p].value = (float)sample;
+			}
+		}
+		return !outPort.isBusy();
+	}
+
+	int delivered() {
+		return (inPort.messages == sent);
+	}
+};
+
+static std::string message(unsigned int i, unsigned int seed) {
+	std::string m;
+	for (unsigned int j = 0; j < 1 + (i * 37 + seed) % 300; j++)
+		m.push_back((char)(i + j));
+	return m;
+}
+
+int main() {
+	unsigned int failed = 0;
+	unsigned int escaped = 0;
+
+	for (unsigned int at = 1; at <= 60; at++) {
+		Link link(at);
+		link.damageAt = at;
+		link.send("first message");
+		link.send("second message");
+		int ok = link.run() && link.delivered();
+		link.outPort.abort();
+		link.send("third message");
+		link.send("fourth message");
+		ok = ok && link.run() && link.delivered();
+		if (!ok) {
+			printf("damage at step %u: %zu of %zu delivered\n", at, link.inPort.messages.size(), link.sent.size());
+			failed++;
+		}
+	}
+
+	for (double noise : {0.001, 0.01, 0.03}) {
+		unsigned long retransmitted = 0;
+		unsigned long steps = 0;
+		for (unsigned int seed = 1; seed <= 50; seed++) {
+			Link link(seed);
+			link.noise = noise;
+			for (unsigned int i = 0; i < 20; i++)
+				link.send(message(i, seed));
+			int drained = link.run();
+			if (link.inPort.escapes)
+				escaped++;
+			if (!drained || (!link.delivered() && !link.inPort.escapes)) {
+				printf("noise %g seed %u: %zu of %zu delivered\n", noise, seed, link.inPort.messages.size(), link.sent.size());
+				failed++;
+			}
+			retransmitted += link.outPort.retransmitted();
+			steps += link.steps;
+		}
+		printf("noise %-6g %10lu steps %8lu retransmitted\n", noise, steps, retransmitted);
+	}
+
+	printf("%u links with checksum escapes, %u failed\n", escaped, failed);
+	return failed?1:0;
+}
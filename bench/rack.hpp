@@ -0,0 +1,38 @@
+#pragma once
+//
+// Minimal stand-in for the parts of rack.hpp used by torpedo.cpp, so that
+// the codec can be built and measured outside of Rack.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <jansson.h>
+
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+
+#define debug(format, ...) fprintf(stderr, "[debug] " format "\n", ##__VA_ARGS__)
+
+namespace rack {
+
+	struct Input {
+		float value = 0.0f;
+		bool active = true;
+	};
+
+	struct Output {
+		float value = 0.0f;
+		bool active = true;
+	};
+
+	struct Module {
+		std::vector<Input> inputs;
+		std::vector<Output> outputs;
+
+		Module(int numParams, int numInputs, int numOutputs, int numLights) : inputs(numInputs), outputs(numOutputs) {}
+		virtual ~Module() {}
+		virtual void step() {}
+	};
+
+}
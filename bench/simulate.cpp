@@ -0,0 +1,334 @@
+/******************************************************
+**
+** Headless link simulator for Torpedo.
+**
+** Builds a patch of many links, each a sender module
+** and a receiver module joined by a simulated cable,
+** and steps it as fast as the CPU allows. Cables are
+** propagated after every step, as in the Rack engine.
+**
+** There are three kinds of link:
+**
+**	patch	TorPatch style: knob sweeps sent as PTCH
+**		whenever the port is not busy
+**	mesg	chatty MESG traffic through a queue
+**	store	TorStore style: a 2 KB raw message sent
+**		once a second
+**
+** Messages offered to a full queue are dropped, so
+** "sent" can be more than "received" for mesg links.
+**
+** Usage: simulate [links [seconds]]
+**
+** With no arguments it runs a sweep over the number of
+** links to show how the cost per port scales, followed
+** by a detailed report for 256 links.
+**
+*******************************************************/
+
+#include "rack.hpp"
+#include "torpedo.hpp"
+#include <chrono>
+#include <random>
+#include <memory>
+
+using namespace rack;
+
+static const float sampleRate = 44100.0f;
+
+typedef std::chrono::steady_clock Clock;
+
+enum LinkTypes {
+	LINK_PATCH,
+	LINK_MESG,
+	LINK_STORE,
+	NUM_LINK_TYPES
+};
+
+static const char *linkNames[NUM_LINK_TYPES] = { "patch", "mesg", "store" };
+
+struct LinkStats {
+	unsigned long sent = 0;
+	unsigned long received = 0;
+	unsigned long bytes = 0;
+	unsigned long errors = 0;
+	unsigned long queueTotal = 0;
+	unsigned int queueMax = 0;
+};
+
+//
+// Senders
+//
+
+struct Sender : Module {
+	LinkStats *stats;
+	std::mt19937 rng;
+	Sender(LinkStats *s, unsigned int seed) : Module(0, 0, 1, 0), rng(seed) { stats = s; }
+	virtual unsigned int queueDepth() { return 0; }
+};
+
+struct PatchSender : Sender {
+	Torpedo::PatchOutputPort outPort = Torpedo::PatchOutputPort(this, 0);
+	float params[3] = { 0.0f, 0.0f, 0.0f };
+	unsigned int sweep = 0;
+	int toSend = 1;
+
+	PatchSender(LinkStats *s, unsigned int seed) : Sender(s, seed) {}
+
+	void step() override {
+		if (sweep) {
+			params[sweep % 3] += 0.001f;
+			sweep--;
+			toSend = 1;
+		}
+		else if (rng() % 2000 == 0) {
+			sweep = 4410;
+		}
+		if (toSend && !outPort.isBusy()) {
+			json_t *rootJ = json_object();
+			json_object_set_new(rootJ, "param1", json_real(params[0]));
+			json_object_set_new(rootJ, "param2", json_real(params[1]));
+			json_object_set_new(rootJ, "param3", json_real(params[2]));
+			outPort.send("TorpedoSim", "TorPatch", rootJ);
+			stats->sent++;
+			toSend = 0;
+		}
+		outPort.process();
+	}
+};
+
+struct MessageSender : Sender {
+	Torpedo::MessageOutputPort outPort = Torpedo::MessageOutputPort(this, 0);
+
+	MessageSender(LinkStats *s, unsigned int seed) : Sender(s, seed) {
+		outPort.size(32);
+	}
+
+	void step() override {
+		if (rng() % 500 == 0) {
+			unsigned int burst = 1 + rng() % 8;
+			for (unsigned int i = 0; i < burst; i++) {
+				outPort.send("TorpedoSim", "Chat", "note " + std::to_string(rng() % 128));
+				stats->sent++;
+			}
+		}
+		outPort.process();
+	}
+
+	unsigned int queueDepth() override { return outPort.queued(); }
+};
+
+struct StoreSender : Sender {
+	Torpedo::RawOutputPort outPort = Torpedo::RawOutputPort(this, 0);
+	std::string message;
+	unsigned int countdown;
+
+	StoreSender(LinkStats *s, unsigned int seed) : Sender(s, seed) {
+		for (unsigned int i = 0; i < 2048; i++)
+			message.push_back('a' + rng() % 26);
+		countdown = rng() % (unsigned int)sampleRate;
+	}
+
+	void step() override {
+		if (!countdown--) {
+			countdown = sampleRate;
+			outPort.send("STOR", message);
+			stats->sent++;
+		}
+		outPort.process();
+	}
+};
+
+//
+// Receivers
+//
+
+struct Receiver : Module {
+	Receiver() : Module(0, 1, 0, 0) {}
+};
+
+struct PatchReceiver : Receiver {
+	struct InPort : Torpedo::PatchInputPort {
+		LinkStats *stats;
+		InPort(Module *module, LinkStats *s) : Torpedo::PatchInputPort(module, 0) { stats = s; }
+		void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) override {
+			if (pluginName.compare("TorpedoSim")) return;
+			stats->received++;
+		}
+		void received(const std::string &appId, const std::string &message) override {
+			stats->bytes += message.length();
+			Torpedo::PatchInputPort::received(appId, message);
+		}
+		void error(unsigned int errorType) override { stats->errors++; }
+	} inPort;
+
+	PatchReceiver(LinkStats *s) : inPort(this, s) {}
+	void step() override { inPort.process(); }
+};
+
+struct MessageReceiver : Receiver {
+	struct InPort : Torpedo::MessageInputPort {
+		LinkStats *stats;
+		InPort(Module *module, LinkStats *s) : Torpedo::MessageInputPort(module, 0) { stats = s; }
+		void received(const std::string &pluginName, const std::string &moduleName, const std::string &message) override {
+			if (pluginName.compare("TorpedoSim")) return;
+			stats->received++;
+		}
+		void received(const std::string &appId, const std::string &message) override {
+			stats->bytes += message.length();
+			Torpedo::MessageInputPort::received(appId, message);
+		}
+		void error(unsigned int errorType) override { stats->errors++; }
+	} inPort;
+
+	MessageReceiver(LinkStats *s) : inPort(this, s) {}
+	void step() override { inPort.process(); }
+};
+
+struct StoreReceiver : Receiver {
+	struct InPort : Torpedo::RawInputPort {
+		LinkStats *stats;
+		InPort(Module *module, LinkStats *s) : Torpedo::RawInputPort(module, 0) { stats = s; }
+		void received(const std::string &appId, const std::string &message) override {
+			stats->received++;
+			stats->bytes += message.length();
+		}
+		void error(unsigned int errorType) override { stats->errors++; }
+	} inPort;
+
+	StoreReceiver(LinkStats *s) : inPort(this, s) {}
+	void step() override { inPort.process(); }
+};
+
+//
+// The simulated patch
+//
+
+struct Link {
+	unsigned int type;
+	LinkStats stats;
+	std::unique_ptr<Sender> sender;
+	std::unique_ptr<Receiver> receiver;
+};
+
+struct Patch {
+	std::vector<std::unique_ptr<Link>> links;
+	std::vector<Sender *> senders[NUM_LINK_TYPES];
+	std::vector<Receiver *> receivers[NUM_LINK_TYPES];
+	double senderTime[NUM_LINK_TYPES] = {};
+	double receiverTime[NUM_LINK_TYPES] = {};
+	double cableTime = 0.0;
+	unsigned long steps = 0;
+
+	Patch(unsigned int count) {
+		for (unsigned int i = 0; i < count; i++) {
+			Link *link = new Link();
+			link->type = i % NUM_LINK_TYPES;
+			switch (link->type) {
+				case LINK_PATCH:
+					link->sender.reset(new PatchSender(&link->stats, i));
+					link->receiver.reset(new PatchReceiver(&link->stats));
+					break;
+				case LINK_MESG:
+					link->sender.reset(new MessageSender(&link->stats, i));
+					link->receiver.reset(new MessageReceiver(&link->stats));
+					break;
+				case LINK_STORE:
+					link->sender.reset(new StoreSender(&link->stats, i));
+					link->receiver.reset(new StoreReceiver(&link->stats));
+					break;
+			}
+			senders[link->type].push_back(link->sender.get());
+			receivers[link->type].push_back(link->receiver.get());
+			links.emplace_back(link);
+		}
+	}
+
+	void step() {
+		for (unsigned int type = 0; type < NUM_LINK_TYPES; type++) {
+			Clock::time_point t = Clock::now();
+			for (Sender *sender : senders[type])
+				sender->step();
+			senderTime[type] += std::chrono::duration<double, std::nano>(Clock::now() - t).count();
+			t = Clock::now();
+			for (Receiver *receiver : receivers[type])
+				receiver->step();
+			receiverTime[type] += std::chrono::duration<double, std::nano>(Clock::now() - t).count();
+		}
+		Clock::time_point t = Clock::now();
+		for (auto &link : links) {
+			link->receiver->inputs[0].value = link->sender->outputs[0].value;
+			unsigned int depth = link->sender->queueDepth();
+			link->stats.queueTotal += depth;
+			link->stats.queueMax = std::max(link->stats.queueMax, depth);
+		}
+		cableTime += std::chrono::duration<double, std::nano>(Clock::now() - t).count();
+		steps++;
+	}
+};
+
+static double run(Patch &patch, float seconds) {
+	unsigned long steps = seconds * sampleRate;
+	Clock::time_point start = Clock::now();
+	for (unsigned long i = 0; i < steps; i++)
+		patch.step();
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(Patch &patch, double wall) {
+	double simulated = patch.steps / sampleRate;
+	printf("%u links, %.1f s simulated in %.2f s: %.1fx real time, %.1f M link-samples/s\n",
+		(unsigned int)patch.links.size(), simulated, wall, simulated / wall,
+		patch.links.size() * patch.steps / wall * 1e-6);
+	printf("%-6s %6s %9s %9s %7s %23s %13s %9s %9s\n", "type", "links", "sent", "received", "errors",
+		"goodput B/s min/avg/max", "queue avg/max", "send ns", "recv ns");
+	for (unsigned int type = 0; type < NUM_LINK_TYPES; type++) {
+		unsigned int count = patch.senders[type].size();
+		if (!count)
+			continue;
+		LinkStats total;
+		double goodputMin = 1e30;
+		double goodputMax = 0.0;
+		for (auto &link : patch.links) {
+			if (link->type != type)
+				continue;
+			double goodput = link->stats.bytes / simulated;
+			goodputMin = std::min(goodputMin, goodput);
+			goodputMax = std::max(goodputMax, goodput);
+			total.sent += link->stats.sent;
+			total.received += link->stats.received;
+			total.bytes += link->stats.bytes;
+			total.errors += link->stats.errors;
+			total.queueTotal += link->stats.queueTotal;
+			total.queueMax = std::max(total.queueMax, link->stats.queueMax);
+		}
+		printf("%-6s %6u %9lu %9lu %7lu %7.0f/%7.0f/%7.0f %9.2f/%3u %9.1f %9.1f\n", linkNames[type], count,
+			total.sent, total.received, total.errors,
+			goodputMin, total.bytes / simulated / count, goodputMax,
+			1.0 * total.queueTotal / patch.steps / count, total.queueMax,
+			patch.senderTime[type] / patch.steps / count, patch.receiverTime[type] / patch.steps / count);
+	}
+	printf("send/recv ns are CPU time per port per step; cables %.1f ns per link per step\n",
+		patch.cableTime / patch.steps / patch.links.size());
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		unsigned int links = std::max(1, atoi(argv[1]));
+		float seconds = (argc > 2) ? atof(argv[2]) : 10.0f;
+		Patch patch(links);
+		report(patch, run(patch, seconds));
+		return 0;
+	}
+
+	printf("%6s %14s %12s\n", "links", "ns/port/step", "x real time");
+	for (unsigned int links = 16; links <= 1024; links *= 4) {
+		Patch patch(links);
+		double wall = run(patch, 1.0f);
+		printf("%6u %14.1f %12.1f\n", links, wall * 1e9 / patch.steps / (links * 2), patch.steps / sampleRate / wall);
+	}
+	printf("\n");
+	Patch patch(256);
+	report(patch, run(patch, 10.0f));
+	return 0;
+}
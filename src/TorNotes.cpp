@@ -6,7 +6,10 @@ struct TorNotes;
 struct TorNotesInput : Torpedo::PatchInputPort {
 	TorNotes *tnModule;
 	TorNotesInput(TorNotes *module, unsigned int portNum) : Torpedo::PatchInputPort((Module *)module, portNum) { tnModule = module; }
-	void received(std::string pluginName, std::string moduleName, json_t *rootJ) override;
+	int accept(const std::string &pluginName, const std::string &moduleName) override {
+		return !pluginName.compare("TorpedoDemo") && !moduleName.compare("TorNotesText");
+	}
+	void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) override;
 };
 
 struct TorNotes : Module {
@@ -37,9 +40,7 @@ struct TorNotesText : LedDisplayTextField {
 	}
 };
 
-void TorNotesInput::received(std::string pluginName, std::string moduleName, json_t *rootJ) {
-	if (pluginName.compare("TorpedoDemo")) return;
-	if (moduleName.compare("TorNotesText")) return;
+void TorNotesInput::received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
 	json_t *text = json_object_get(rootJ, "text");
 	if (text) {
 		tnModule->text.assign(json_string_value(text));
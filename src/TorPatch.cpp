@@ -42,12 +42,14 @@ struct TorPatchOutputPort : Torpedo::PatchOutputPort {
 
 	//
 	// I have to subclass the PatchInputPort so that I can override the
-	// received method to actually get at received messages
+	// received method to actually get at received messages, and the
+	// accept method to turn away messages for other modules cheaply
 	//
 struct TorPatchInputPort : Torpedo::PatchInputPort {
 	TorPatch *tpModule;
 	TorPatchInputPort(TorPatch *module, unsigned int portNum):Torpedo::PatchInputPort((Module *)module, portNum) {tpModule = module;};
-	void received(std::string pluginName, std::string moduleName, json_t *rootJ) override;
+	int accept(const std::string &pluginName, const std::string &moduleName) override;
+	void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) override;
 	void error(unsigned int errorType) override;
 };
 
@@ -165,21 +167,28 @@ void TorPatch::step() {
 }
 
 	//
-	// This received method is called whenever the PatchInputPort receives
-	// a message using the PTCH protocol. It will extract the pluginName,
-	// moduleName and the patch json from the message and pass it in here
+	// This accept method is called with the pluginName and moduleName
+	// before the rest of the message is decoded.
 	//
 	// In this method I'm rejecting any message of a type I don't want
 	// to process.
+	//
+int TorPatchInputPort::accept(const std::string &pluginName, const std::string &moduleName) {
+	return !pluginName.compare(TOSTRING(SLUG)) && !moduleName.compare("TorPatch");
+}
+
+	//
+	// This received method is called whenever the PatchInputPort receives
+	// a message using the PTCH protocol that I have accepted. It will
+	// extract the pluginName, moduleName and the patch json from the
+	// message and pass it in here
+	//
 	// Set the tiny received light
 	// Place the received parameters into the module
 	// If the module is headless, update the parameters directly.
 	// Otherwise the isDirty flag will signal the moduleWidget to update.
 	//
-void TorPatchInputPort::received(std::string pluginName, std::string moduleName, json_t *rootJ) {
-
-	if (pluginName.compare(TOSTRING(SLUG))) return;
-	if (moduleName.compare("TorPatch")) return;
+void TorPatchInputPort::received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
 
 	tpModule->receive.trigger(0.1f);
 
@@ -314,12 +323,14 @@ struct TorPatchWidget : ModuleWidget {
 
 	//
 	// I have to subclass the PatchInputPort so that I can override the
-	// received method to actually get at received messages
+	// received method to actually get at received messages, and the
+	// accept method to turn away messages for other modules cheaply
 	//
 struct TorPatchNanoInputPort : Torpedo::PatchInputPort {
 	TorPatchNano *tpModule;
 	TorPatchNanoInputPort(TorPatchNano *module, unsigned int portNum):Torpedo::PatchInputPort((Module *)module, portNum) {tpModule = module;};
-	void received(std::string pluginName, std::string moduleName, json_t *rootJ) override;
+	int accept(const std::string &pluginName, const std::string &moduleName) override;
+	void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) override;
 	void error(unsigned int errorType) override;
 };
 
@@ -385,19 +396,26 @@ void TorPatchNano::step() {
 }
 
 	//
-	// This received method is called whenever the PatchInputPort receives
-	// a message using the PTCH protocol. It will extract the pluginName,
-	// moduleName and the patch json from the message and pass it in here
+	// This accept method is called with the pluginName and moduleName
+	// before the rest of the message is decoded.
 	//
 	// In this method I'm rejecting any message of a type I don't want
 	// to process.
+	//
+int TorPatchNanoInputPort::accept(const std::string &pluginName, const std::string &moduleName) {
+	return !pluginName.compare(TOSTRING(SLUG)) && !moduleName.compare("TorPatch");
+}
+
+	//
+	// This received method is called whenever the PatchInputPort receives
+	// a message using the PTCH protocol that I have accepted. It will
+	// extract the pluginName, moduleName and the patch json from the
+	// message and pass it in here
+	//
 	// Set the tiny received light
 	// Place the received parameters into the module
 	//
-void TorPatchNanoInputPort::received(std::string pluginName, std::string moduleName, json_t *rootJ) {
-
-	if (pluginName.compare(TOSTRING(SLUG))) return;
-	if (moduleName.compare("TorPatch")) return;
+void TorPatchNanoInputPort::received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
 
 	tpModule->receive.trigger(0.1f);
 
@@ -32,7 +32,7 @@ struct TorStore;		// Forward declarations, because I want to
 struct TorStoreInputPort : Torpedo::RawInputPort {
 	TorStore *tpModule;
 	TorStoreInputPort(TorStore *module, unsigned int portNum):Torpedo::RawInputPort((Module *)module, portNum) {tpModule = module;};
-	void received(std::string appId, std::string message) override;
+	void received(const std::string &appId, const std::string &message) override;
 };
 
 struct TorStore : Module  {
@@ -172,10 +172,10 @@ void TorStore::fromJson(json_t *rootJ) {
 	// This received method is called whenever the Raw receives
 	// a message.
 	//
-void TorStoreInputPort::received(std::string appId, std::string message) {
+void TorStoreInputPort::received(const std::string &appId, const std::string &message) {
 	int portNum = _portNum - TorStore::INPUT_TOR_1;
 	tpModule->apps[portNum].assign(appId);
-	tpModule->messages[portNum].assign(message);
+	take(tpModule->messages[portNum]);
 }
 
 struct TorStoreWidget : ModuleWidget {
@@ -1,4 +1,6 @@
 #include "torpedo.hpp"
+#include <algorithm>
+#include <cstring>
 using namespace Torpedo;
 
 void BasePort::addCheckSum(unsigned int byte, unsigned int counter) {
@@ -6,6 +8,119 @@ void BasePort::addCheckSum(unsigned int byte, unsigned int counter) {
 	_checksum &= 0xffffffff;
 }
 
+//
+// GF(256) arithmetic for the forward error correction. Parity byte j of a
+// group is the sum over the data bytes i of cauchy(j, i, parity) times the
+// byte. Every square part of a Cauchy matrix can be inverted, so any set of
+// up to parity lost samples in a group can be solved for.
+//
+
+struct GaloisField {
+	unsigned char exp[512];
+	unsigned char log[256];
+
+	GaloisField() {
+		unsigned int x = 1;
+		for (unsigned int i = 0; i < 255; i++) {
+			exp[i] = exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= 0x11d;
+		}
+		exp[510] = exp[511] = 0;
+		log[0] = 0;
+	}
+	unsigned int mul(unsigned int a, unsigned int b) const { return (a && b)?exp[log[a] + log[b]]:0; }
+	unsigned int inv(unsigned int a) const { return exp[255 - log[a]]; }
+	unsigned int cauchy(unsigned int j, unsigned int i, unsigned int parity) const { return inv(j ^ (parity + i)); }
+};
+
+static const GaloisField gf;
+
+//
+// The check byte carried by error corrected samples, a CRC-8 of the tag
+// and data byte.
+//
+
+unsigned int BasePort::check(unsigned int byte, unsigned int tag) {
+	unsigned int crc = 0;
+	unsigned int bits = ((tag & 0xff) << 8) | (byte & 0xff);
+	for (int i = 15; i >= 0; i--) {
+		unsigned int top = ((crc >> 7) ^ (bits >> i)) & 1;
+		crc = (crc << 1) & 0xff;
+		if (top)
+			crc ^= 0x07;
+	}
+	return crc;
+}
+
+//
+// The preset dictionary for compressed bodies. Matches may reach back into
+// it as if it came before the body, so the first mention of an envelope key
+// is as cheap as a repeat. Strings used most are nearest the end, and it
+// must never change, as both ends have to agree on it.
+//
+
+static const char dictionary[] =
+	"\"version\": \"\"model\": \"\"data\": {\"id\": "
+	"\"params\": [{\"paramId\": , \"value\": }, {\"paramId\": "
+	"\"text\": \"\"messages\": [\"param1\": \"param2\": \"param3\": "
+	"0.00000000000000000, \"Torpedo\", \"TorPatch\", \"TorNotes\"}}"
+	"{\"plugin\": \"\", \"module\": \"\", \"message\": \"\", \"patch\": {\"";
+static const unsigned int dictionaryLength = sizeof(dictionary) - 1;
+static const unsigned int hashBits = 12;
+
+static unsigned int hash4(const unsigned char *p) {
+	unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	return (v * 2654435761u) >> (32 - hashBits);
+}
+
+static void appendRun(std::string &buffer, unsigned int run) {
+	while (run >= 255) {
+		buffer.push_back((char)255);
+		run -= 255;
+	}
+	buffer.push_back(run);
+}
+
+static int readRun(const unsigned char *bytes, unsigned int &index, unsigned int end, unsigned int &run) {
+	unsigned int byte;
+	do {
+		if (index >= end)
+			return 0;
+		byte = bytes[index++];
+		run += byte;
+	} while (byte == 255);
+	return 1;
+}
+
+void BasePort::appendLength(std::string &buffer, unsigned int length) {
+	do {
+		buffer.push_back((length & 0x7f) | ((length > 0x7f)?0x80:0));
+		length >>= 7;
+	} while (length);
+}
+
+//
+// Read a length written by appendLength, returning zero if it runs off the
+// end of the buffer or is too long to be valid.
+//
+
+int BasePort::readLength(const std::string &buffer, unsigned int &index, unsigned int &length) {
+	unsigned int shift = 0;
+	unsigned int byte;
+	length = 0;
+	do {
+		if ((index >= buffer.length()) || (shift > 28))
+			return 0;
+		byte = (unsigned char)buffer[index++];
+		length |= (byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return 1;
+}
+
 void BasePort::raiseError(unsigned int errorType) {
 	_state = STATE_QUIESCENT;
 	_checksum = 0;
@@ -22,376 +137,2465 @@ void BasePort::raiseError(unsigned int errorType) {
 		case ERROR_CHECKSUM:
 			if (dbg) debug("Torpedo Error: CHECKSUM");
 			break;
+		case ERROR_SIZE:
+			if (dbg) debug("Torpedo Error: SIZE");
+			break;
 	}
 	error(errorType);
 }
 
 void RawOutputPort::abort(void) {
 	_state = STATE_ABORTING;
-	_message.clear();
-	_counter = 0;
+	_pending = 0;
+	_frame.clear();
+	_frame.push_back(0x3f00);
+	_position = 0;
 }
 
 void RawOutputPort::completed(void) {
 	if (dbg) debug("Torpedo Completed:");
 }
 
+void RawOutputPort::fec(unsigned int data, unsigned int parity) {
+	_fecParity = (parity < maxParity)?parity:maxParity;
+	_fecData = std::max(1u, std::min(data, 255 - _fecParity));
+}
+
+unsigned int RawOutputPort::flags(void) {
+	unsigned int f = _compressing?FLAG_COMPRESSED:0;
+	if (_fecParity)
+		return f | FLAG_FEC;
+	return f | (_wide?FLAG_WIDE:0) | (_interval?FLAG_CHECKED:0);
+}
+
 void RawOutputPort::process(void) {
-	int portValue = 0;
-	switch (_state) {
-		case STATE_HEADER:
-			switch (_counter) {
-				case 0:
-					_checksum = 0;
-					portValue = 0x1000 | (_appId.length()?_appId[0]:0);
-					_counter++;
-					break;
-				case 1:
-				case 2:
-				case 3:
-					portValue = 0x1000 | (_counter * 0x100) | ((_appId.length() > _counter)?_appId[_counter]:0);
-					_counter++;
-					break;
-				case 4:
-				case 5:
-				case 6:
-				case 7:
-					portValue = 0x1000 | (_counter * 0x100) | (_message.length() >> (8 * (_counter - 4)) & 0xff);
-					_counter++;
-					break;
-				case 8:
-				case 9:
-				case 10:
-				case 11:
-				case 12:
-				case 13:
-				case 14:
-					portValue = 0x1000 | (_counter * 0x100);
-					_counter++;
-					break;
-				case 15:
-					portValue = 0x1000 | (_counter * 0x100);
-					_counter = 0;
-					_state = STATE_BODY;
-			}
-			addCheckSum(portValue & 0xff, _counter + 3);
-			break;
-		case STATE_BODY:
-			portValue = 0x2000 | ((_counter % 0x10) * 0x100) | _message[_counter];
-			addCheckSum(portValue & 0xff, _counter);
-			_counter++;
-			if (_counter == _message.length()) {
-				_counter = 0;
-				_state = STATE_TRAILER;
+	float value;
+	processBlock(&value, 1);
+	_port->value = value;
+}
+
+void RawOutputPort::processBlock(float *samples, unsigned int count) {
+	_clock += count;
+	while (count) {
+		if (_position >= _frame.size()) {
+			if (_pending)
+				pull();
+			else
+				next();
+			if (_position >= _frame.size()) {
+				std::fill(samples, samples + count, 0.0f);
+				return;
 			}
-			break;
-		case STATE_TRAILER:
-			switch (_counter) {
-				case 0:
-				case 1:
-				case 2:
-					portValue = 0x3000 | (_counter * 0x100) | (_checksum & 0xff);
-					_checksum >>= 8;
-					_counter++;
-					break;
-				case 3:
-					portValue = 0x3000 | (_counter * 0x100) | (_checksum & 0xff);
-					_counter = 0;
-					_state = STATE_QUIESCENT;
-					completed();
-					break;
+		}
+		unsigned int n = std::min(count, (unsigned int)_frame.size() - _position);
+		std::copy(_frame.begin() + _position, _frame.begin() + _position + n, samples);
+		samples += n;
+		count -= n;
+		_position += n;
+		if ((_position == _frame.size()) && !_pending) {
+			unsigned int state = _state;
+			_state = STATE_QUIESCENT;
+			if (state != STATE_ABORTING)
+				completed();
+		}
+	}
+}
+
+//
+// Render the next chunk of a streamed body in place of the samples already
+// output, adding the trailer after the last one.
+//
+
+void RawOutputPort::pull(void) {
+	// Error corrected chunks are whole groups
+	unsigned int length = std::min(_pending, _fecParity?(chunkSize / _fecData * _fecData):chunkSize);
+	unsigned int filled = 0;
+	_chunk.resize(chunkSize);
+	while (filled < length) {
+		unsigned int n = produce(&_chunk[filled], length - filled);
+		if (!n) {
+			// Only this frame is abandoned, not anything queued behind it,
+			// and it ends without completed() being called
+			if (dbg) debug("Torpedo Underrun:");
+			raiseError(ERROR_LENGTH);
+			RawOutputPort::abort();
+			return;
+		}
+		filled += std::min(n, length - filled);
+	}
+	_frame.clear();
+	_position = 0;
+	renderBody(_chunk.data(), length, _streamed);
+	_streamed += length;
+	_pending -= length;
+	if (!_pending)
+		renderTrailer();
+}
+
+//
+// Encode the whole frame into sample values, so that process() only has
+// to step through them. Each sample carries one byte, or two if pack is
+// set, along with the state and a counter.
+//
+
+void RawOutputPort::render(const char *message, unsigned int length) {
+	renderHeader(length);
+	renderBody(message, length, 0);
+	renderTrailer();
+}
+
+//
+// start is the offset of bytes within the body, which must fall on a group
+// boundary when error correcting.
+//
+
+void RawOutputPort::renderBody(const char *bytes, unsigned int length, unsigned int start) {
+	if (!_fecParity) {
+		unsigned int counter = (_wide?(start / 2):start) % 0x10;
+		if (!_interval) {
+			renderBytes(STATE_BODY, bytes, length, _wide, start, counter);
+			return;
+		}
+		counter = (counter + start / _interval) % 0x10;
+		unsigned int index = 0;
+		while (index < length) {
+			unsigned int offset = start + index;
+			unsigned int count = std::min(length - index, (offset / _interval + 1) * _interval - offset);
+			renderBytes(STATE_BODY, bytes + index, count, _wide, offset, counter);
+			counter = (counter + (_wide?((count + 1) / 2):count)) % 0x10;
+			index += count;
+			offset += count;
+			if (!(offset % _interval) && (offset < _bodyLength)) {
+				unsigned int fold = (_checksum ^ (_checksum >> 16)) & 0xffff;
+				_frame.push_back(1.0f * ((STATE_BODY << 12) | (counter << 8) | (fold & 0xff) | ((fold >> 8) << 16)));
+				counter = (counter + 1) % 0x10;
 			}
-			break;
-		case STATE_ABORTING:
-			portValue = 0x3f00;
-				_counter = 0;
-			if (_message.length() > 0) {
-				_state = STATE_HEADER;
+		}
+		return;
+	}
+	unsigned int counter = ((start / _fecData) * (_fecData + _fecParity)) % 0x10;
+	unsigned int parity[maxParity];
+	for (unsigned int group = 0; group < length; group += _fecData) {
+		unsigned int count = std::min(_fecData, length - group);
+		std::fill(parity, parity + _fecParity, 0);
+		for (unsigned int i = 0; i < count + _fecParity; i++) {
+			unsigned int byte;
+			if (i < count) {
+				byte = (unsigned char)bytes[group + i];
+				addCheckSum(byte, start + group + i);
+				for (unsigned int j = 0; j < _fecParity; j++)
+					parity[j] ^= gf.mul(gf.cauchy(j, i, _fecParity), byte);
 			}
 			else {
-				_state = STATE_QUIESCENT;
+				byte = parity[i - count];
 			}
-			break;
-		case STATE_QUIESCENT:
-			portValue = 0;
-			break;
+			unsigned int tag = (STATE_BODY << 4) | counter;
+			_frame.push_back(1.0f * ((tag << 8) | byte | (check(byte, tag) << 16)));
+			counter = (counter + 1) % 0x10;
+		}
+	}
+}
+
+void RawOutputPort::renderHeader(unsigned int length) {
+	unsigned int headerFlags = flags();
+	_checksum = 0;
+	_bodyLength = length;
+	_header.assign(_appId, 0, 4);
+	_header.resize(4, 0);
+	if (isCompact()) {
+		_header.push_back(headerFlags);
+		if (headerFlags & FLAG_FEC) {
+			_header.push_back(_fecData);
+			_header.push_back(_fecParity);
+		}
+		if (headerFlags & FLAG_CHECKED) {
+			_header.push_back(_interval & 0xff);
+			_header.push_back(_interval >> 8);
+		}
+		appendLength(_header, length);
+		renderBytes(STATE_COMPACT_HEADER, _header.data(), _header.length(), 1, 0, 0);
+	}
+	else {
+		for (unsigned int i = 0; i < 4; i++)
+			_header.push_back((length >> (8 * i)) & 0xff);
+		_header.push_back(headerFlags);
+		_header.push_back(_fecData);
+		_header.push_back(_fecParity);
+		_header.push_back((headerFlags & FLAG_CHECKED)?(_interval & 0xff):0);
+		_header.push_back((headerFlags & FLAG_CHECKED)?(_interval >> 8):0);
+		_header.resize(16, 0);
+		renderBytes(STATE_HEADER, _header.data(), _header.length(), 0, 0, 0);
+	}
+}
+
+void RawOutputPort::renderTrailer(void) {
+	_header.clear();
+	for (unsigned int i = 0; i < 4; i++)
+		_header.push_back((_checksum >> (8 * i)) & 0xff);
+	renderBytes(STATE_TRAILER, _header.data(), _header.length(), isCompact(), 0, 0);
+}
+
+//
+// start is the offset of bytes within the section, for rendering a body a
+// chunk at a time, and counter that of the first sample. start must be even
+// when pack is set.
+//
+
+void RawOutputPort::renderBytes(unsigned int state, const char *bytes, unsigned int length, unsigned int pack, unsigned int start, unsigned int counter) {
+	unsigned int index = 0;
+	while (index < length) {
+		unsigned int portValue = (state << 12) | (counter << 8) | (unsigned char)bytes[index];
+		addCheckSum(bytes[index], start + index);
+		index++;
+		if (pack && (index < length)) {
+			portValue |= ((unsigned char)bytes[index]) << 16;
+			addCheckSum(bytes[index], start + index);
+			index++;
+		}
+		_frame.push_back(1.0f * portValue);
+		counter = (counter + 1) % 0x10;
 	}
-	_port->value = 1.0f * portValue;
 }
 
-void RawOutputPort::send(std::string appId, std::string message) {
+void RawOutputPort::send(const std::string &appId, const std::string &message) {
 	_appId.assign(appId);
 	send(message);
 }
 
-void RawOutputPort::send(std::string message) {
-	if (!_port->active) return;
-	if (!message.length()) {
-		raiseError(ERROR_LENGTH);
+void RawOutputPort::send(const std::string &message) {
+	transmit(message.data(), message.length());
+}
+
+void RawOutputPort::send(std::string &&message) {
+	transmit(message.data(), message.length());
+}
+
+void RawOutputPort::send(const char *message, unsigned int length) {
+	transmit(message, length);
+}
+
+void RawOutputPort::sendStream(const std::string &appId, unsigned int length) {
+	_appId.assign(appId);
+	sendStream(length);
+}
+
+void RawOutputPort::sendStream(unsigned int length) {
+	if (!start(length))
 		return;
+	if (dbg) debug("Torpedo Send:%s streaming %u bytes", _appId.c_str(), length);
+	renderHeader(length);
+	_streamed = 0;
+	_pending = length;
+	_state = STATE_HEADER;
+}
+
+//
+// Get ready to render a new frame, aborting any frame in flight. Returns
+// zero if nothing should be sent.
+//
+
+int RawOutputPort::start(unsigned int length) {
+	if (!_port->active) return 0;
+	if (!length) {
+		raiseError(ERROR_LENGTH);
+		return 0;
 	}
-	if (dbg) debug("Torpedo Send:%s %s", _appId.c_str(), message.c_str());
 	switch (_state) {
 		case STATE_HEADER:
-		case STATE_BODY:
-		case STATE_TRAILER:
 			abort();
 			break;
 		case STATE_ABORTING:
 			break;
 		case STATE_QUIESCENT:
-			_state = STATE_HEADER;
+			_frame.clear();
+			_position = 0;
 			break;
 	}
-	_message.assign(message);
+	return 1;
+}
+
+void RawOutputPort::transmit(const char *message, unsigned int length) {
+	if (!start(length))
+		return;
+	if (dbg) debug("Torpedo Send:%s %.*s", _appId.c_str(), length, message);
+	if (_compress && (length >= minCompress)) {
+		shrink(message, length);
+		if (_compressed.length() < length) {
+			if (dbg) debug("Torpedo Compressed: %u to %u bytes", length, (unsigned int)_compressed.length());
+			_compressing = 1;
+			message = _compressed.data();
+			length = _compressed.length();
+		}
+	}
+	render(message, length);
+	_compressing = 0;
+	_state = STATE_HEADER;
+}
+
+//
+// Compress a body into _compressed: its length, then a series of LZ77
+// sequences as in LZ4. Each sequence is a token byte holding the number of
+// literals in the top nibble and the match length less 4 in the bottom,
+// either of which runs on in extra bytes when it is 15, then the literals,
+// then a 16 bit offset back from the end of the output so far, then the
+// extra bytes of the match length. The last sequence is literals only.
+//
+
+void RawOutputPort::shrink(const char *message, unsigned int length) {
+	_window.assign(dictionary, dictionaryLength);
+	_window.append(message, length);
+	_hashes.assign(1u << hashBits, 0);
+	const unsigned char *window = (const unsigned char *)_window.data();
+	unsigned int end = _window.length();
+	// Positions are stored plus one, so zero is empty
+	for (unsigned int i = 0; i + 4 <= dictionaryLength; i++)
+		_hashes[hash4(window + i)] = i + 1;
+	_compressed.clear();
+	appendLength(_compressed, length);
+	unsigned int anchor = dictionaryLength;
+	unsigned int position = dictionaryLength;
+	while (position + 4 <= end) {
+		unsigned int h = hash4(window + position);
+		unsigned int candidate = _hashes[h];
+		_hashes[h] = position + 1;
+		if (!candidate || (position + 1 - candidate > 0xffff) || memcmp(window + candidate - 1, window + position, 4)) {
+			position++;
+			continue;
+		}
+		candidate--;
+		unsigned int match = 4;
+		while ((position + match < end) && (window[candidate + match] == window[position + match]))
+			match++;
+		unsigned int literals = position - anchor;
+		_compressed.push_back((std::min(literals, 15u) << 4) | std::min(match - 4, 15u));
+		if (literals >= 15)
+			appendRun(_compressed, literals - 15);
+		_compressed.append((const char *)window + anchor, literals);
+		unsigned int offset = position - candidate;
+		_compressed.push_back(offset & 0xff);
+		_compressed.push_back(offset >> 8);
+		if (match - 4 >= 15)
+			appendRun(_compressed, match - 4 - 15);
+		for (unsigned int i = 1; (i < match) && (position + i + 4 <= end); i++)
+			_hashes[hash4(window + position + i)] = position + i + 1;
+		position += match;
+		anchor = position;
+	}
+	unsigned int literals = end - anchor;
+	_compressed.push_back(std::min(literals, 15u) << 4);
+	if (literals >= 15)
+		appendRun(_compressed, literals - 15);
+	_compressed.append((const char *)window + anchor, literals);
+}
+
+unsigned int RawInputPort::_reserved = 0;
+unsigned int RawInputPort::maxMessageSize = 16 * 1024 * 1024;
+unsigned int RawInputPort::receiveBudget = 64 * 1024 * 1024;
+unsigned int RawInputPort::keepSize = 64 * 1024;
+
+//
+// The decoder keeps the state and counter nibbles it expects in the next
+// sample in _expect, so validating a sample is a single comparison. Body
+// samples are decoded in a tight loop straight into the preallocated
+// message buffer. _message holds the body from offset _base, and chunk()
+// is called when _received reaches _flush; without streaming that is only
+// at the end of the body.
+//
+
+void RawInputPort::begin(unsigned int tag, unsigned int data) {
+	unsigned int state = tag >> 4;
+	if (!state)
+		return;
+	if ((state != STATE_HEADER) && (state != STATE_COMPACT_HEADER)) {
+		if (_state != STATE_SKIPPING)
+			lost(ERROR_STATE);
+		return;
+	}
+	if (tag & 0x0f) {
+		if (_state != STATE_SKIPPING)
+			lost(ERROR_COUNTER);
+		return;
+	}
+	_state = state;
+	_compact = (state == STATE_COMPACT_HEADER);
 	_counter = 0;
+	_checksum = 0;
+	_appId.clear();
+	_flags = 0;
+	_length = 0;
+	_fecData = 0;
+	_fecParity = 0;
+	_interval = 0;
+	header(data & 0xff, 0);
+	if (_compact)
+		header((data >> 16) & 0xff, 1);
+	_counter++;
+	_expect = (_state << 4) | _counter;
 }
 
-void RawInputPort::process(void) {
-	if (!_port->active) {
-		_state = STATE_QUIESCENT;
-		_checksum = 0;
+inline void RawInputPort::body(unsigned int data) {
+	unsigned int index = _received;
+	if ((_flags & FLAG_WIDE) && (index + 2 <= _length)) {
+		_message[index - _base] = data & 0xff;
+		_message[index - _base + 1] = (data >> 16) & 0xff;
+		_checksum += ((data & 0xff) | ((data >> 8) & 0xff00)) << ((index & 3) << 3);
+		_received = index + 2;
+	}
+	else {
+		if (index < _length)
+			_message[index - _base] = data & 0xff;
+		_checksum += (data & 0xff) << ((index & 3) << 3);
+		_received = index + 1;
+	}
+	_counter = (_counter + 1) & 0x0f;
+	_expect = (_state << 4) | _counter;
+	if (_received >= _flush)
+		chunk();
+}
+
+inline void RawInputPort::store(unsigned int byte) {
+	_message[_received - _base] = byte;
+	_checksum += byte << ((_received & 3) << 3);
+	_received++;
+	if (_received >= _flush)
+		chunk();
+}
+
+//
+// Called when _received reaches _flush, at the end of the buffer when
+// streaming, at a check sample, or at the end of the body.
+//
+
+void RawInputPort::chunk(void) {
+	if (_interval && (_received < _length) && !(_received % _interval)) {
+		_state = STATE_CHECK;
 		return;
 	}
-	unsigned int data = (unsigned int)(_port->value);
-	if ((data & 0xff00) == 0x3f00) {
+	advance();
+}
+
+void RawInputPort::advance(void) {
+	if (_streaming) {
+		unsigned int length = std::min(_received, _length) - _base;
+		if (length)
+			onChunk(_message.data(), length);
+		_base = _received;
+	}
+	_flush = std::min(_length, _base + (unsigned int)_message.size());
+	if (_interval)
+		_flush = std::min(_flush, (_received / _interval + 1) * _interval);
+	if (_received >= _length) {
+		_state = STATE_TRAILER;
+		_counter = 0;
+		_expect = (_state << 4);
+	}
+}
+
+void RawInputPort::decode(float sample) {
+	unsigned int data = (unsigned int)sample;
+	unsigned int tag = (data >> 8) & 0xff;
+	if (tag == 0x3f) {
+		end(0);
 		_state = STATE_QUIESCENT;
 		_checksum = 0;
 		return;
 	}
-	unsigned int state = data >> 12;
-	unsigned int counter = (data & 0x0f00) >> 8;
-	data &= 0xff;
+	if ((_state == STATE_QUIESCENT) || (_state == STATE_SKIPPING)) {
+		begin(tag, data);
+		return;
+	}
+	if ((_state == STATE_BODY) && (_flags & FLAG_FEC)) {
+		fecSample(data, tag);
+		return;
+	}
+	if (tag != _expect) {
+		lost(((tag ^ _expect) & 0xf0)?ERROR_STATE:ERROR_COUNTER);
+		return;
+	}
+	unsigned int low = data & 0xff;
+	unsigned int high = (data >> 16) & 0xff;
 	switch (_state) {
-		case STATE_QUIESCENT:
-			if (!state)
-				return;
-			addCheckSum(data, counter);
-			if (state == 1) {
-				_counter = 0;
-				_message.clear();
-				_state = STATE_HEADER;
-				if (counter != _counter) {
-					raiseError(ERROR_COUNTER);
-					return;
-				}
-				_appId.clear();
-				_appId.push_back(data);
-				_length = 0;
-				return;
-			}		
-			raiseError(ERROR_STATE);
-			return;
 		case STATE_HEADER:
-			addCheckSum(data, counter);
-			if (state != _state) {
-				raiseError(ERROR_STATE);
-				return;
-			}
-			_counter++;
-			if (counter != _counter) {
-				raiseError(ERROR_COUNTER);
+			if (header(low, _counter)) {
+				beginBody();
 				return;
 			}
-			switch (counter) {
-				case 0:
-				case 1:
-				case 2:
-				case 3:
-					_appId.push_back(data);
-					break;
-				case 4:
-				case 5:
-				case 6:
-				case 7:
-					_length >>= 8;
-					_length += (data << 24);
-					break;
-				case 8:
-				case 9:
-				case 10:
-				case 11:
-				case 12:
-				case 13:
-				case 14:
-					break;
-				case 15:
-					_state = STATE_BODY;
-					_message.reserve(_length);
-					_counter = 0;
-					break;
-			}
 			break;
-		case STATE_BODY:
-			addCheckSum(data, counter);
-			if (state != _state) {
-				raiseError(ERROR_STATE);
-				return;
-			}
-			if (counter != _counter++) {
-				raiseError(ERROR_COUNTER);
+		case STATE_COMPACT_HEADER:
+			if (header(low, _counter * 2) || header(high, _counter * 2 + 1)) {
+				beginBody();
 				return;
 			}
-			_counter %= 16;
-			_message.push_back(data);
-			if (_message.length() >= _length) {
-				_state = STATE_TRAILER;
-				_counter = 0;
+			if (_counter >= 6) {
+				lost(ERROR_LENGTH);
 				return;
 			}
 			break;
-		case STATE_TRAILER:
-			if (state != _state) {
-				raiseError(ERROR_STATE);
-				return;
-			}
-			if (counter != _counter) {
-				raiseError(ERROR_COUNTER);
+		case STATE_BODY:
+			body(data);
+			return;
+		case STATE_CHECK:
+			if ((low | (high << 8)) != ((_checksum ^ (_checksum >> 16)) & 0xffff)) {
+				lost(ERROR_CHECKSUM);
 				return;
 			}
-			if (_message.length() != _length) {
-				raiseError(ERROR_LENGTH);
+			_state = STATE_BODY;
+			_counter = (_counter + 1) & 0x0f;
+			_expect = (_state << 4) | _counter;
+			advance();
+			return;
+		case STATE_TRAILER:
+			if (_received != _length) {
+				lost(ERROR_LENGTH);
 				return;
 			}
-			if (data != (_checksum & 0xff)) {
-				raiseError(ERROR_CHECKSUM);
+			if (low != (_checksum & 0xff)) {
+				lost(ERROR_CHECKSUM);
 				return;
 			}
 			_checksum >>= 8;
-			_counter++;
-			if (_counter == 4) {
+			if (_compact) {
+				if (high != (_checksum & 0xff)) {
+					lost(ERROR_CHECKSUM);
+					return;
+				}
+				_checksum >>= 8;
+			}
+			if (_counter + 1 == (_compact?2u:4u)) {
 				_state = STATE_QUIESCENT;
 				_checksum = 0;
-				received(_appId, _message);
+				if (!_inSync) {
+					_inSync = 1;
+					syncRegained();
+				}
+				if (!_streaming) {
+					if ((_flags & FLAG_COMPRESSED) && !expand())
+						return;
+					if (_flags & FLAG_SEQUENCED)
+						sequenced();
+					else if (_flags & FLAG_SEGMENT)
+						segment();
+					else if (_flags & FLAG_BATCH)
+						unbatch();
+					else
+						received(_appId, _message);
+				}
+				end(1);
+				return;
 			}
-			return;
+			break;
 	}
+	_counter++;
+	_expect = (_state << 4) | _counter;
 }
 
-void RawInputPort::received(std::string appId, std::string message) {
-	if (dbg) debug("Torpedo Received:%s %s", appId.c_str(), message.c_str());
+unsigned int RawInputPort::decodeBody(const float *samples, unsigned int count) {
+	if (_flags & FLAG_FEC)
+		return 0;
+	unsigned int i;
+	for (i = 0; (i < count) && (_state == STATE_BODY); i++) {
+		unsigned int data = (unsigned int)samples[i];
+		if (((data >> 8) & 0xff) != _expect)
+			break;
+		body(data);
+	}
+	return i;
 }
 
-void TextInputPort::received(std::string appId, std::string message) {
-	if (!appId.compare("TEXT"))
-		received(message);
+//
+// Check a message of length bytes against the size limits, and that size
+// bytes more can be buffered within the receive budget.
+//
+
+int RawInputPort::allowed(unsigned int length, unsigned int size) {
+	if ((length > maxMessageSize) || (_maxSize && (length > _maxSize)))
+		return 0;
+	return (_reserved + size <= receiveBudget);
 }
 
-void QueuedOutputPort::abort() {
-	RawOutputPort::abort();
-	for (auto i : _queue) delete i;
-	_queue.clear();
+void RawInputPort::beginBody(void) {
+	unsigned int stream = _stream && !(_flags & (FLAG_BATCH | FLAG_SEGMENT | FLAG_SEQUENCED | FLAG_COMPRESSED));
+	unsigned int size = _length;
+	if (!(_flags & FLAG_CHECKED) || (_flags & FLAG_FEC))
+		_interval = 0;
+	else if (!_interval || ((_flags & FLAG_WIDE) && (_interval & 1))) {
+		lost(ERROR_LENGTH);
+		return;
+	}
+	// Chunks are kept even so that wide samples never straddle two
+	if (stream)
+		size = std::min(_length, _interval?_interval:std::max(2u, _stream & ~1u));
+	if ((_flags & FLAG_FEC) && (!_fecData || !_fecParity || (_fecParity > RawOutputPort::maxParity) || (_fecData + _fecParity > 255))) {
+		lost(ERROR_LENGTH);
+		return;
+	}
+	if (!allowed(_length, size)) {
+		if (dbg) debug("Torpedo Oversize: %u bytes", _length);
+		raiseError(ERROR_SIZE);
+		_state = STATE_SKIPPING;
+		return;
+	}
+	_held = size;
+	_reserved += size;
+	_state = STATE_BODY;
+	_counter = 0;
+	_expect = (_state << 4);
+	_received = 0;
+	_base = 0;
+	_flush = _interval?std::min(size, _interval):size;
+	_fill = 0;
+	_groupData = std::min(_fecData, _length);
+	if (stream) {
+		_streaming = 1;
+		onBegin(_appId, _length);
+	}
+	if ((_message.capacity() < size) && _pool.size()) {
+		_message.swap(_pool.back());
+		_pool.pop_back();
+	}
+	_message.resize(size);
 }
 
-void QueuedOutputPort::process() {
-	if (!RawOutputPort::isBusy()) {
-		if (_queue.size()) {
-			std::string *s = _queue.front();
-			_queue.erase(_queue.begin());
-			RawOutputPort::send(std::string(*s));
-			delete s;
+//
+// Replace a compressed body in _message with what it expands to. See
+// RawOutputPort::shrink() for the format. Any inconsistency raises
+// ERROR_LENGTH, which has already passed its checksum so is not a framing
+// error. The expanded length is reserved against the receive budget with
+// the rest of the frame, and a failed expansion frees its buffer.
+//
+
+int RawInputPort::expand(void) {
+	unsigned int index = 0;
+	unsigned int length;
+	if (!readLength(_message, index, length)) {
+		raiseError(ERROR_LENGTH);
+		return 0;
+	}
+	if (!allowed(length, length)) {
+		if (dbg) debug("Torpedo Oversize: %u bytes expanded", length);
+		raiseError(ERROR_SIZE);
+		return 0;
+	}
+	// Held with the frame, so end() gives it back either way
+	_held += length;
+	_reserved += length;
+	if ((_expanded.capacity() < length) && _pool.size()) {
+		_expanded.swap(_pool.back());
+		_pool.pop_back();
+	}
+	_expanded.resize(length);
+	const unsigned char *in = (const unsigned char *)_message.data();
+	unsigned int end = _message.length();
+	unsigned int out = 0;
+	while (index < end) {
+		unsigned int token = in[index++];
+		unsigned int literals = token >> 4;
+		if ((literals == 15) && !readRun(in, index, end, literals))
+			break;
+		if ((literals > end - index) || (literals > length - out))
+			break;
+		memcpy(&_expanded[out], in + index, literals);
+		index += literals;
+		out += literals;
+		if (index == end) {
+			if (out != length)
+				break;
+			_message.swap(_expanded);
+			return 1;
 		}
+		if (end - index < 2)
+			break;
+		unsigned int offset = in[index] | (in[index + 1] << 8);
+		index += 2;
+		unsigned int match = (token & 0x0f) + 4;
+		if (((token & 0x0f) == 0x0f) && !readRun(in, index, end, match))
+			break;
+		if (!offset || (offset > out + dictionaryLength) || (match > length - out))
+			break;
+		// Byte by byte, as the match may overlap what it produces
+		for (unsigned int i = 0; i < match; i++, out++)
+			_expanded[out] = (out < offset)?dictionary[dictionaryLength + out - offset]:_expanded[out - offset];
 	}
-	RawOutputPort::process();
+	std::string().swap(_expanded);
+	raiseError(ERROR_LENGTH);
+	return 0;
 }
 
-void QueuedOutputPort::send(std::string message) {
-	if (QueuedOutputPort::isBusy()) {
-		if (_queue.size() >= _size) {
-			if (!_replace)
-				return;
-			std::string *s = _queue.back();
-			_queue.pop_back();
-			delete s;
-			if (dbg) debug("Torpedo Replaced:");
+//
+// Error corrected samples that fail their check are marked as erased.
+// Once a group is complete, the erased samples are rebuilt and the data
+// passed on to store().
+//
+
+void RawInputPort::fecSample(unsigned int data, unsigned int tag) {
+	unsigned int byte = data & 0xff;
+	_group[_fill] = byte;
+	_erased[_fill] = (tag != _expect) || (((data >> 16) & 0xff) != check(byte, _expect));
+	_fill++;
+	_counter = (_counter + 1) & 0x0f;
+	_expect = (STATE_BODY << 4) | _counter;
+	if (_fill < _groupData + _fecParity)
+		return;
+	if (!repair()) {
+		lost(ERROR_CHECKSUM);
+		return;
+	}
+	for (unsigned int i = 0; i < _groupData; i++)
+		store(_group[i]);
+	_fill = 0;
+	_groupData = std::min(_fecData, _length - _received);
+	_expect = (_state << 4) | _counter;
+}
+
+//
+// Rebuild the erased data samples of the group from the parity samples,
+// returning zero if there are too many to recover.
+//
+
+int RawInputPort::repair(void) {
+	unsigned int lost[RawOutputPort::maxParity];
+	unsigned int rows[RawOutputPort::maxParity];
+	unsigned int matrix[RawOutputPort::maxParity][RawOutputPort::maxParity + 1];
+	unsigned int erasures = 0;
+	for (unsigned int i = 0; i < _groupData; i++) {
+		if (_erased[i]) {
+			if (erasures == _fecParity)
+				return 0;
+			lost[erasures++] = i;
 		}
-		{
-			std::string *s = new std::string(message);
-			_queue.push_back(s);
-			if (dbg) debug("Torpedo Queued:");
+	}
+	if (!erasures)
+		return 1;
+	unsigned int count = 0;
+	for (unsigned int j = 0; (j < _fecParity) && (count < erasures); j++)
+		if (!_erased[_groupData + j])
+			rows[count++] = j;
+	if (count < erasures)
+		return 0;
+	for (unsigned int r = 0; r < erasures; r++) {
+		unsigned int j = rows[r];
+		unsigned int sum = _group[_groupData + j];
+		for (unsigned int i = 0; i < _groupData; i++)
+			if (!_erased[i])
+				sum ^= gf.mul(gf.cauchy(j, i, _fecParity), _group[i]);
+		for (unsigned int c = 0; c < erasures; c++)
+			matrix[r][c] = gf.cauchy(j, lost[c], _fecParity);
+		matrix[r][erasures] = sum;
+	}
+	for (unsigned int c = 0; c < erasures; c++) {
+		unsigned int pivot = c;
+		while ((pivot < erasures) && !matrix[pivot][c])
+			pivot++;
+		if (pivot == erasures)
+			return 0;
+		if (pivot != c)
+			std::swap(matrix[pivot], matrix[c]);
+		unsigned int scale = gf.inv(matrix[c][c]);
+		for (unsigned int k = c; k <= erasures; k++)
+			matrix[c][k] = gf.mul(matrix[c][k], scale);
+		for (unsigned int r = 0; r < erasures; r++) {
+			if ((r == c) || !matrix[r][c])
+				continue;
+			unsigned int factor = matrix[r][c];
+			for (unsigned int k = c; k <= erasures; k++)
+				matrix[r][k] ^= gf.mul(factor, matrix[c][k]);
 		}
-		return;
 	}
-	RawOutputPort::send(message);
+	for (unsigned int c = 0; c < erasures; c++)
+		_group[lost[c]] = matrix[c][erasures];
+	_repaired += erasures;
+	if (dbg) debug("Torpedo Repaired: %u", erasures);
+	return 1;
 }
 
-void QueuedOutputPort::size(unsigned int s) {
-	if (s < 1) {
-		return;
+//
+// Finish the frame in progress, if there is one
+//
+
+RawInputPort::~RawInputPort() {
+	end(0);
+}
+
+//
+// Called whenever the input is unplugged, to drop anything half received
+// and give back its share of the receive budget.
+//
+
+void RawInputPort::disconnect(void) {
+	end(0);
+	_state = STATE_QUIESCENT;
+	_checksum = 0;
+}
+
+void RawInputPort::end(int ok) {
+	_reserved -= _held;
+	_held = 0;
+	trim(_message);
+	trim(_expanded);
+	trim(_record);
+	if (_streaming) {
+		_streaming = 0;
+		onEnd(ok);
 	}
-	_size = s;
 }
 
-void MessageOutputPort::send(std::string pluginName, std::string moduleName, std::string message) {
-	json_t *rootJ = json_object();
-	json_object_set_new(rootJ, "plugin", json_string(pluginName.c_str()));
-	json_object_set_new(rootJ, "module", json_string(moduleName.c_str()));
-	json_object_set_new(rootJ, "message", json_string(message.c_str()));
-	char *msg = json_dumps(rootJ, 0);
-	json_decref(rootJ);
-	QueuedOutputPort::send(std::string(msg));
-	free(msg);
+//
+// Handle one header byte, returning non-zero once the header is complete
+//
+
+int RawInputPort::header(unsigned int byte, unsigned int index) {
+	addCheckSum(byte, index);
+	if (index < 4) {
+		_appId.push_back(byte);
+		return 0;
+	}
+	if (_compact) {
+		unsigned int fec = (_flags & FLAG_FEC)?2:0;
+		unsigned int start = 5 + fec + ((_flags & FLAG_CHECKED)?2:0);
+		if (index == 4)
+			_flags = byte;
+		else if ((index == 5) && fec)
+			_fecData = byte;
+		else if ((index == 6) && fec)
+			_fecParity = byte;
+		else if (index < start)
+			_interval |= byte << (8 * (index - 5 - fec));
+		if (index < start)
+			return 0;
+		_length |= (byte & 0x7f) << (7 * (index - start));
+		return !(byte & 0x80);
+	}
+	if (index < 8)
+		_length |= byte << (8 * (index - 4));
+	else if (index == 8)
+		_flags = byte;
+	else if (index == 9)
+		_fecData = byte;
+	else if (index == 10)
+		_fecParity = byte;
+	else if (index < 13)
+		_interval |= byte << (8 * (index - 11));
+	return (index == 15);
 }
 
-void MessageInputPort::received(std::string appId, std::string message) {
-	if (dbg) debug("Torpedo Received: %s", message.c_str());
-	std::string pluginName;
-	std::string moduleName;
-	std::string messageText;
+void RawInputPort::process(void) {
+	if (!_port->active) {
+		disconnect();
+		return;
+	}
+	decode(_port->value);
+}
 
-	if (appId.compare("MESG"))
+void RawInputPort::processBlock(const float *samples, unsigned int count) {
+	if (!_port->active) {
+		disconnect();
 		return;
-	json_error_t error;
-	json_t *rootJ = json_loads(message.c_str(), 0, &error);
-	if (!rootJ) {
-		if (dbg) debug("Torpedo MESG Error: %s", error.text);
-		return;
-	} 
-	json_t *jp = json_object_get(rootJ, "plugin");
-	if (json_is_string(jp)) 
-		pluginName.assign(json_string_value(jp));
-	json_t *jm = json_object_get(rootJ, "module");
-	if (json_is_string(jm))
-		moduleName.assign(json_string_value(jm));
-	json_t *jt = json_object_get(rootJ, "message");
-	if (json_is_string(jt))
-		messageText.assign(json_string_value(jt));
-	json_decref(rootJ);
-	received(pluginName, moduleName, messageText);
+	}
+	unsigned int i = 0;
+	while (i < count) {
+		if (_state == STATE_BODY)
+			i += decodeBody(samples + i, count - i);
+		if (i < count)
+			decode(samples[i++]);
+	}
 }
 
-void PatchOutputPort::send(std::string pluginName, std::string moduleName, json_t *rootJ) {
-	json_t *wrapper = json_object();
-	json_object_set_new(wrapper, "plugin", json_string(pluginName.c_str()));
-	json_object_set_new(wrapper, "module", json_string(moduleName.c_str()));
-	json_object_set_new(wrapper, "patch", rootJ);
-	char *msg = json_dumps(wrapper, 0);
-	json_decref(wrapper);
-	QueuedOutputPort::send(std::string(msg));
-	free(msg);
+//
+// A framing error means the port has lost sync with the sender. It is
+// reported once, then samples are skipped quietly until the next header,
+// and errors in frames that follow go unreported until one arrives intact.
+//
+
+void RawInputPort::lost(unsigned int errorType) {
+	if (_inSync) {
+		raiseError(errorType);
+		_inSync = 0;
+		syncLost();
+	}
+	else {
+		end(0);
+	}
+	_state = STATE_SKIPPING;
+	_checksum = 0;
 }
 
-void PatchInputPort::received(std::string appId, std::string message) {
-	if (dbg) debug("Torpedo Received: %s", message.c_str());
-	std::string pluginName;
-	std::string moduleName;
+void RawInputPort::raiseError(unsigned int errorType) {
+	end(0);
+	BasePort::raiseError(errorType);
+}
 
-	if (appId.compare("PTCH"))
+void RawInputPort::received(const std::string &appId, const std::string &message) {
+	if (dbg) debug("Torpedo Received:%s %s", appId.c_str(), message.c_str());
+}
+
+//
+// Received messages are passed by reference to the port's own buffer, which
+// is only valid until received() returns. A subclass that wants to keep the
+// message takes it; the reference is then empty and the port carries on
+// with a buffer from its pool, or with the storage that was swapped in.
+// Buffers finished with can be handed back with recycle().
+//
+
+void RawInputPort::recycle(std::string &&buffer) {
+	if ((_pool.size() < poolSize) && (buffer.capacity() <= keepSize)) {
+		buffer.clear();
+		_pool.push_back(std::move(buffer));
+	}
+}
+
+//
+// Free a buffer that has grown past keepSize, rather than keep it for the
+// next message.
+//
+
+void RawInputPort::trim(std::string &buffer) {
+	if (buffer.capacity() > keepSize)
+		std::string().swap(buffer);
+}
+
+std::string RawInputPort::take(void) {
+	std::string buffer;
+	take(buffer);
+	return buffer;
+}
+
+void RawInputPort::take(std::string &buffer) {
+	std::string &current = _unbatching?_record:_message;
+	if (!buffer.capacity() && _pool.size()) {
+		buffer.swap(_pool.back());
+		_pool.pop_back();
+	}
+	buffer.swap(current);
+	current.clear();
+}
+
+void RawInputPort::unbatch(void) {
+	// Check the record lengths before delivering anything
+	for (int deliver = 0; deliver < 2; deliver++) {
+		unsigned int index = 0;
+		while (index < _message.length()) {
+			unsigned int length;
+			if (!readLength(_message, index, length) || (length > _message.length() - index)) {
+				raiseError(ERROR_LENGTH);
+				return;
+			}
+			if (deliver) {
+				_record.assign(_message, index, length);
+				_unbatching = 1;
+				received(_appId, _record);
+				_unbatching = 0;
+			}
+			index += length;
+		}
+	}
+}
+
+//
+// Segments are only understood by a ChannelInputPort, and sequenced
+// segments by a ReliableInputPort
+//
+
+void RawInputPort::segment(void) {
+	if (dbg) debug("Torpedo Segment Ignored:");
+}
+
+void RawInputPort::sequenced(void) {
+	if (dbg) debug("Torpedo Sequenced Segment Ignored:");
+}
+
+void TextInputPort::received(const std::string &appId, const std::string &message) {
+	if (!appId.compare("TEXT"))
+		received(message);
+}
+
+void QueuedOutputPort::abort() {
+	RawOutputPort::abort();
+	for (unsigned int i = 0; i < _count; i++)
+		dropped((_head + i) % _queue.size());
+	_head = 0;
+	_count = 0;
+	_bytes = 0;
+}
+
+void QueuedOutputPort::next() {
+	while (_count && isExpired(_head)) {
+		if (dbg) debug("Torpedo Expired:");
+		_expired++;
+		dropped(_head);
+		pop();
+	}
+	if (_batch && (_count > 1) && (_queue[_head].length() + 5 <= _batch)) {
+		sendBatch();
+	}
+	else if (_count) {
+		_batched = 0;
+		transmit(_queue[_head].data(), _queue[_head].length());
+		pop();
+	}
+}
+
+//
+// Make room for a message of the given length, returning the slot to
+// hold it, or nullptr if the message is to be dropped.
+//
+
+std::string *QueuedOutputPort::enqueue(unsigned int length) {
+	if (_budget && (length > _budget))
+		return nullptr;
+	if ((_count >= _queue.size()) || (_budget && (_bytes + length > _budget))) {
+		if (!_replace || !_count)
+			return nullptr;
+		_count--;
+		_bytes -= _queue[(_head + _count) % _queue.size()].length();
+		dropped((_head + _count) % _queue.size());
+		if (dbg) debug("Torpedo Replaced:");
+		if (_budget && (_bytes + length > _budget))
+			return nullptr;
+	}
+	unsigned int index = (_head + _count) % _queue.size();
+	std::string *slot = &(_queue[index]);
+	_keys[index].clear();
+	_deadlines[index] = _ttl?(_clock + _ttl):0;
+	_count++;
+	_bytes += length;
+	if (dbg) debug("Torpedo Queued:");
+	return slot;
+}
+
+void QueuedOutputPort::pop() {
+	_bytes -= _queue[_head].length();
+	_head = (_head + 1) % _queue.size();
+	_count--;
+}
+
+void QueuedOutputPort::send(const std::string &message) {
+	send(message.data(), message.length());
+}
+
+void QueuedOutputPort::send(std::string &&message) {
+	if (QueuedOutputPort::isBusy()) {
+		std::string *slot = enqueue(message.length());
+		if (slot)
+			slot->swap(message);
+		return;
+	}
+	_batched = 0;
+	transmit(message.data(), message.length());
+}
+
+void QueuedOutputPort::send(const char *message, unsigned int length) {
+	if (QueuedOutputPort::isBusy()) {
+		std::string *slot = enqueue(length);
+		if (slot)
+			slot->assign(message, length);
+		return;
+	}
+	_batched = 0;
+	transmit(message, length);
+}
+
+//
+// Send a MESG or PTCH envelope, keyed on its plugin and module so that
+// dropped() can tell which it was, and coalesced on that key if
+// coalescing. Returns 0 if it was dropped.
+//
+
+int QueuedOutputPort::sendEnvelope(const std::string &pluginName, const std::string &moduleName, const char *envelope, unsigned int length) {
+	_keyBuffer.assign(pluginName);
+	_keyBuffer.push_back('\n');
+	_keyBuffer.append(moduleName);
+	if (_coalesce)
+		return sendKeyed(_keyBuffer, envelope, length);
+	if (QueuedOutputPort::isBusy())
+		return queue(_keyBuffer, envelope, length);
+	_batched = 0;
+	transmit(envelope, length);
+	return 1;
+}
+
+int QueuedOutputPort::isQueued(const std::string &key) {
+	for (unsigned int i = 0; i < _count; i++) {
+		if (!_keys[(_head + i) % _queue.size()].compare(key))
+			return 1;
+	}
+	return 0;
+}
+
+int QueuedOutputPort::sendKeyed(const std::string &key, const std::string &message) {
+	return sendKeyed(key, message.data(), message.length());
+}
+
+int QueuedOutputPort::sendKeyed(const std::string &key, const char *message, unsigned int length) {
+	if (QueuedOutputPort::isBusy()) {
+		for (unsigned int i = 0; (i < _count) && !key.empty(); i++) {
+			unsigned int index = (_head + i) % _queue.size();
+			if (_keys[index].compare(key))
+				continue;
+			if (_budget && (_bytes - _queue[index].length() + length > _budget))
+				return 0;
+			_bytes -= _queue[index].length();
+			_bytes += length;
+			_queue[index].assign(message, length);
+			_deadlines[index] = _ttl?(_clock + _ttl):0;
+			_coalesced++;
+			if (dbg) debug("Torpedo Coalesced:");
+			return 1;
+		}
+		return queue(key, message, length);
+	}
+	_batched = 0;
+	transmit(message, length);
+	return 1;
+}
+
+int QueuedOutputPort::queue(const std::string &key, const char *message, unsigned int length) {
+	std::string *slot = enqueue(length);
+	if (!slot)
+		return 0;
+	slot->assign(message, length);
+	_keys[slot - _queue.data()].assign(key);
+	return 1;
+}
+
+void QueuedOutputPort::sendStream(unsigned int length) {
+	if (QueuedOutputPort::isBusy()) {
+		if (dbg) debug("Torpedo Busy: stream of %u bytes refused", length);
+		return;
+	}
+	_batched = 0;
+	RawOutputPort::sendStream(length);
+}
+
+void QueuedOutputPort::sendBatch() {
+	_batchBuffer.clear();
+	while (_count) {
+		if (isExpired(_head)) {
+			_expired++;
+			dropped(_head);
+			pop();
+			continue;
+		}
+		std::string &s = _queue[_head];
+		if (_batchBuffer.length() + s.length() + 5 > _batch)
+			break;
+		appendLength(_batchBuffer, s.length());
+		_batchBuffer.append(s);
+		pop();
+	}
+	if (dbg) debug("Torpedo Batched:");
+	_batched = 1;
+	transmit(_batchBuffer.data(), _batchBuffer.length());
+}
+
+//
+// The queue is a ring of reusable strings. Resizing keeps the oldest
+// messages that still fit.
+//
+
+void QueuedOutputPort::size(unsigned int s) {
+	if (s < 1) {
+		return;
+	}
+	std::vector<std::string> queue(s);
+	std::vector<std::string> keys(s);
+	std::vector<unsigned long long> deadlines(s);
+	unsigned int count = std::min(_count, s);
+	for (unsigned int i = count; i < _count; i++)
+		dropped((_head + i) % _queue.size());
+	_bytes = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int index = (_head + i) % _queue.size();
+		queue[i].swap(_queue[index]);
+		keys[i].swap(_keys[index]);
+		deadlines[i] = _deadlines[index];
+		_bytes += queue[i].length();
+	}
+	_queue.swap(queue);
+	_keys.swap(keys);
+	_deadlines.swap(deadlines);
+	_head = 0;
+	_count = count;
+	_size = s;
+}
+
+void ChannelOutputPort::abort() {
+	RawOutputPort::abort();
+	for (Channel &c : _channels) {
+		c._queue.clear();
+		c._offset = 0;
+	}
+}
+
+void ChannelOutputPort::channel(unsigned int c, const std::string &appId, unsigned int priority) {
+	if (c > 0xff)
+		return;
+	if (c >= _channels.size())
+		_channels.resize(c + 1);
+	_channels[c]._appId.assign(appId);
+	_channels[c]._priority = priority;
+}
+
+int ChannelOutputPort::isBusy() {
+	if (_state != STATE_QUIESCENT)
+		return 1;
+	for (Channel &c : _channels)
+		if (c._queue.size())
+			return 1;
+	return 0;
+}
+
+//
+// Pick the channel to send the next segment from, and send it
+//
+
+void ChannelOutputPort::next() {
+	unsigned int count = _channels.size();
+	unsigned int best = count;
+	for (unsigned int i = 1; i <= count; i++) {
+		unsigned int c = (_last + i) % count;
+		if (_channels[c]._queue.empty())
+			continue;
+		if ((best == count) || (_channels[c]._priority > _channels[best]._priority))
+			best = c;
+	}
+	if (best == count)
+		return;
+	_last = best;
+	Channel &c = _channels[best];
+	std::string &message = c._queue.front();
+	unsigned int length = std::min(_segmentSize, (unsigned int)message.length() - c._offset);
+	unsigned int segmentFlags = c._offset?0:SEGMENT_FIRST;
+	if (c._offset + length == message.length())
+		segmentFlags |= SEGMENT_LAST;
+	_segment.clear();
+	_segment.push_back(best);
+	_segment.push_back(segmentFlags);
+	if (segmentFlags & SEGMENT_FIRST)
+		appendLength(_segment, message.length());
+	_segment.append(message, c._offset, length);
+	c._offset += length;
+	if (segmentFlags & SEGMENT_LAST) {
+		c._queue.pop_front();
+		c._offset = 0;
+	}
+	_appId.assign(c._appId);
+	transmit(_segment.data(), _segment.length());
+}
+
+unsigned int ChannelOutputPort::queued(unsigned int c) {
+	return (c < _channels.size())?_channels[c]._queue.size():0;
+}
+
+void ChannelOutputPort::send(unsigned int c, const std::string &message) {
+	send(c, std::string(message));
+}
+
+void ChannelOutputPort::send(unsigned int c, std::string &&message) {
+	if (c >= _channels.size()) {
+		if (dbg) debug("Torpedo No Channel: %u", c);
+		return;
+	}
+	if (_channels[c]._queue.size() >= _channels[c]._size) {
+		if (dbg) debug("Torpedo Channel Full: %u", c);
+		return;
+	}
+	_channels[c]._queue.push_back(std::move(message));
+}
+
+//
+// Send a MESG or PTCH envelope on channel c, in binary if the channel's
+// appId is MESB or PTCB. As with PatchOutputPort, rootJ is taken over.
+//
+
+void ChannelOutputPort::send(unsigned int c, const std::string &pluginName, const std::string &moduleName, const std::string &message) {
+	if (c >= _channels.size()) {
+		if (dbg) debug("Torpedo No Channel: %u", c);
+		return;
+	}
+	messageEnvelope(_envelope, !_channels[c]._appId.compare("MESB"), pluginName, moduleName, message);
+	send(c, _envelope);
+}
+
+void ChannelOutputPort::send(unsigned int c, const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
+	if (c >= _channels.size()) {
+		if (dbg) debug("Torpedo No Channel: %u", c);
+		json_decref(rootJ);
+		return;
+	}
+	patchEnvelope(_envelope, !_channels[c]._appId.compare("PTCB"), pluginName, moduleName, rootJ);
+	json_decref(rootJ);
+	send(c, _envelope);
+}
+
+void ChannelOutputPort::size(unsigned int c, unsigned int s) {
+	if ((c < _channels.size()) && s)
+		_channels[c]._size = s;
+}
+
+//
+// Partly assembled messages count against the receive budget like a frame
+// being received does.
+//
+
+ChannelInputPort::~ChannelInputPort() {
+	disconnect();
+}
+
+void ChannelInputPort::disconnect() {
+	RawInputPort::disconnect();
+	for (Channel &channel : _channels)
+		discard(channel);
+}
+
+void ChannelInputPort::discard(Channel &channel) {
+	if (channel._active)
+		_reserved -= channel._length;
+	channel._active = 0;
+	channel._message.clear();
+	trim(channel._message);
+}
+
+void ChannelInputPort::received(unsigned int c, const std::string &appId, const std::string &message) {
+	if (_channels[c]._route)
+		_channels[c]._route->received(appId, message);
+	else
+		received(appId, message);
+}
+
+void ChannelInputPort::route(unsigned int c, RawInputPort *port) {
+	if (c > 0xff)
+		return;
+	if (c >= _channels.size())
+		_channels.resize(c + 1);
+	_channels[c]._route = port;
+}
+
+void ChannelInputPort::segment(void) {
+	if (_message.length() < 2) {
+		raiseError(ERROR_LENGTH);
+		return;
+	}
+	unsigned int c = (unsigned char)_message[0];
+	unsigned int segmentFlags = (unsigned char)_message[1];
+	unsigned int index = 2;
+	if (c >= _channels.size())
+		_channels.resize(c + 1);
+	Channel &channel = _channels[c];
+	if (segmentFlags & SEGMENT_FIRST) {
+		unsigned int length;
+		discard(channel);
+		if (!readLength(_message, index, length)) {
+			raiseError(ERROR_LENGTH);
+			return;
+		}
+		if (!allowed(length, length)) {
+			raiseError(ERROR_SIZE);
+			return;
+		}
+		channel._appId.assign(_appId);
+		channel._length = length;
+		channel._active = 1;
+		channel._message.reserve(length);
+		_reserved += length;
+	}
+	else if (!channel._active) {
+		// The start of this message was lost
+		return;
+	}
+	if (_message.length() - index > channel._length - channel._message.length()) {
+		discard(channel);
+		raiseError(ERROR_LENGTH);
+		return;
+	}
+	channel._message.append(_message, index, std::string::npos);
+	if (segmentFlags & SEGMENT_LAST) {
+		if (channel._message.length() != channel._length) {
+			discard(channel);
+			raiseError(ERROR_LENGTH);
+			return;
+		}
+		_reserved -= channel._length;
+		channel._active = 0;
+		// Delivered from _record so that take() works as usual
+		_record.swap(channel._message);
+		_unbatching = 1;
+		received(c, channel._appId, _record);
+		_unbatching = 0;
+		_record.swap(channel._message);
+		channel._message.clear();
+		trim(channel._message);
+	}
+}
+
+void ReliableOutputPort::AckInputPort::received(const std::string &appId, const std::string &message) {
+	if (appId.compare("ACKN"))
+		return;
+	_ack.assign(message);
+	_fresh = 1;
+}
+
+unsigned int ReliableOutputPort::_epochs = 0;
+
+void ReliableOutputPort::abort() {
+	RawOutputPort::abort();
+	_queue.clear();
+	_window.clear();
+	_offset = 0;
+	_synced = 0;
+	_epoch = ++_epochs & 0xffff;
+}
+
+//
+// An acknowledgement is the next sequence number the receiver expects,
+// followed by a 16 bit bitmap of the segments after that it already has
+// and the epoch it is synchronised to, if it knows it.
+//
+
+void ReliableOutputPort::acknowledged(const std::string &ack) {
+	if (ack.length() < 3)
+		return;
+	unsigned int epoch = (ack.length() < 5)?_epoch:((unsigned char)ack[3] | ((unsigned char)ack[4] << 8));
+	if (((ack.length() < 5) && !_synced) || (epoch != _epoch))
+		return;
+	unsigned int acked = ((unsigned char)ack[0] - _base) & 0xff;
+	unsigned int bitmap = (unsigned char)ack[1] | ((unsigned char)ack[2] << 8);
+	if (acked > _window.size())
+		return;
+	_synced = 1;
+	for (unsigned int i = 0; i < acked; i++)
+		_window[i]._acked = 1;
+	unsigned int highest = acked;
+	for (unsigned int i = 0; i < 16; i++) {
+		unsigned int index = acked + 1 + i;
+		if ((bitmap & (1 << i)) && (index < _window.size())) {
+			_window[index]._acked = 1;
+			highest = index;
+		}
+	}
+	// Anything sent before a segment that has arrived is missing
+	for (unsigned int i = acked; i < highest; i++) {
+		if (!_window[i]._acked && (_window[i]._sent < _window[highest]._sent))
+			_window[i]._resend = 1;
+	}
+	while (_window.size() && _window.front()._acked) {
+		_window.pop_front();
+		_base = (_base + 1) & 0xff;
+	}
+}
+
+void ReliableOutputPort::next() {
+	for (Segment &segment : _window) {
+		if (segment._acked)
+			continue;
+		if (segment._resend || (_clock - segment._sent > _timeout)) {
+			if (dbg) debug("Torpedo Retransmit:");
+			segment._resend = 0;
+			segment._sent = _clock;
+			_retransmitted++;
+			// The window may have moved on since it was first sent
+			if ((unsigned char)segment._body[1] & SEGMENT_RESET)
+				segment._body[4] = _base;
+			_appId.assign(segment._appId);
+			transmit(segment._body.data(), segment._body.length());
+			return;
+		}
+	}
+	if ((_window.size() >= _windowSize) || _queue.empty())
+		return;
+	std::string &message = _queue.front();
+	unsigned int length = std::min(_segmentSize, (unsigned int)message.length() - _offset);
+	unsigned int segmentFlags = _offset?0:SEGMENT_FIRST;
+	if (_offset + length == message.length())
+		segmentFlags |= SEGMENT_LAST;
+	if (!_synced)
+		segmentFlags |= SEGMENT_RESET;
+	_window.emplace_back();
+	Segment &segment = _window.back();
+	segment._appId.assign(_appId);
+	segment._body.push_back((_base + _window.size() - 1) & 0xff);
+	segment._body.push_back(segmentFlags);
+	if (segmentFlags & SEGMENT_RESET) {
+		segment._body.push_back(_epoch & 0xff);
+		segment._body.push_back(_epoch >> 8);
+		segment._body.push_back(_base);
+	}
+	if (segmentFlags & SEGMENT_FIRST)
+		appendLength(segment._body, message.length());
+	segment._body.append(message, _offset, length);
+	segment._sent = _clock;
+	_offset += length;
+	if (segmentFlags & SEGMENT_LAST) {
+		_queue.pop_front();
+		_offset = 0;
+	}
+	transmit(segment._body.data(), segment._body.length());
+}
+
+void ReliableOutputPort::process() {
+	_ackPort.process();
+	if (_ackPort._fresh) {
+		_ackPort._fresh = 0;
+		acknowledged(_ackPort._ack);
+	}
+	RawOutputPort::process();
+}
+
+void ReliableOutputPort::send(const std::string &message) {
+	send(std::string(message));
+}
+
+void ReliableOutputPort::send(std::string &&message) {
+	if (_queue.size() >= _size) {
+		if (dbg) debug("Torpedo Reliable Queue Full:");
+		return;
+	}
+	_queue.push_back(std::move(message));
+}
+
+void ReliableOutputPort::send(const char *message, unsigned int length) {
+	send(std::string(message, length));
+}
+
+void ReliableInputPort::assemble(const std::string &appId, const std::string &segment) {
+	unsigned int segmentFlags = (unsigned char)segment[1];
+	unsigned int index = (segmentFlags & SEGMENT_RESET)?5:2;
+	if (segmentFlags & SEGMENT_FIRST) {
+		unsigned int length;
+		discard();
+		if (!readLength(segment, index, length)) {
+			raiseError(ERROR_LENGTH);
+			return;
+		}
+		if (!allowed(length, length)) {
+			raiseError(ERROR_SIZE);
+			return;
+		}
+		_assemblyId.assign(appId);
+		_assemblyLength = length;
+		_assembling = 1;
+		_assembly.reserve(length);
+		_reserved += length;
+	}
+	else if (!_assembling) {
+		return;
+	}
+	if (segment.length() - index > _assemblyLength - _assembly.length()) {
+		discard();
+		raiseError(ERROR_LENGTH);
+		return;
+	}
+	_assembly.append(segment, index, std::string::npos);
+	if (segmentFlags & SEGMENT_LAST) {
+		if (_assembly.length() != _assemblyLength) {
+			discard();
+			raiseError(ERROR_LENGTH);
+			return;
+		}
+		_reserved -= _assemblyLength;
+		_assembling = 0;
+		_record.swap(_assembly);
+		_unbatching = 1;
+		received(_assemblyId, _record);
+		_unbatching = 0;
+		_record.swap(_assembly);
+		_assembly.clear();
+	trim(_assembly);
+	}
+}
+
+ReliableInputPort::~ReliableInputPort() {
+	discard();
+}
+
+void ReliableInputPort::disconnect() {
+	RawInputPort::disconnect();
+	discard();
+}
+
+void ReliableInputPort::discard() {
+	if (_assembling)
+		_reserved -= _assemblyLength;
+	_assembling = 0;
+	_assembly.clear();
+	trim(_assembly);
+}
+
+void ReliableInputPort::process() {
+	RawInputPort::process();
+	if (_ackPending && !_ackPort.isBusy()) {
+		_ack.clear();
+		_ack.push_back(_expected);
+		_ack.push_back((_bitmap >> 1) & 0xff);
+		_ack.push_back((_bitmap >> 9) & 0xff);
+		if (_epoch != noEpoch) {
+			_ack.push_back(_epoch & 0xff);
+			_ack.push_back(_epoch >> 8);
+		}
+		_ackPort.send("ACKN", _ack);
+		_ackPending = 0;
+	}
+	_ackPort.process();
+}
+
+//
+// Segments are held in _slots until all those before them have arrived.
+// Bit n of _bitmap is set when the segment n after _expected is held.
+//
+
+void ReliableInputPort::sequenced() {
+	if (_message.length() < 2) {
+		raiseError(ERROR_LENGTH);
 		return;
+	}
+	unsigned int sequence = (unsigned char)_message[0];
+	unsigned int segmentFlags = (unsigned char)_message[1];
+	unsigned int offset = (sequence - _expected) & 0xff;
+	unsigned int epoch = _epoch;
+	unsigned int base = sequence;
+	if (segmentFlags & SEGMENT_RESET) {
+		if (_message.length() < 5) {
+			raiseError(ERROR_LENGTH);
+			return;
+		}
+		epoch = (unsigned char)_message[2] | ((unsigned char)_message[3] << 8);
+		base = (unsigned char)_message[4];
+	}
+	if (!_synced || (epoch != _epoch)) {
+		if (dbg) debug("Torpedo Resync: %u epoch %u base %u", sequence, epoch, base);
+		discard();
+		_expected = base;
+		_epoch = epoch;
+		_bitmap = 0;
+		_synced = 1;
+		offset = (sequence - base) & 0xff;
+	}
+	_ackPending = 1;
+	if (offset >= ReliableOutputPort::maxWindow)
+		return;
+	if (!(_bitmap & (1 << offset))) {
+		unsigned int slot = sequence % ReliableOutputPort::maxWindow;
+		_slots[slot].swap(_message);
+		_slotIds[slot].assign(_appId);
+		_bitmap |= (1 << offset);
+	}
+	while (_bitmap & 1) {
+		unsigned int slot = _expected % ReliableOutputPort::maxWindow;
+		assemble(_slotIds[slot], _slots[slot]);
+		trim(_slots[slot]);
+		_bitmap >>= 1;
+		_expected = (_expected + 1) & 0xff;
+	}
+}
+
+//
+// MessagePack encoding of jansson values. Only the types that JSON can
+// hold are written, and unpackJson() rejects anything else.
+//
+
+static const unsigned int maxPackDepth = 64;
+
+static void packBig(std::string &buffer, unsigned long long value, unsigned int bytes) {
+	while (bytes--)
+		buffer.push_back((value >> (bytes * 8)) & 0xff);
+}
+
+static int readBig(const std::string &buffer, unsigned int &index, unsigned int bytes, unsigned long long &value) {
+	if (buffer.length() - index < bytes)
+		return 0;
+	value = 0;
+	while (bytes--)
+		value = (value << 8) | (unsigned char)buffer[index++];
+	return 1;
+}
+
+static void packCount(std::string &buffer, unsigned int count, unsigned int fix, unsigned int fixLimit, unsigned int code) {
+	if (count < fixLimit) {
+		buffer.push_back(fix | count);
+	}
+	else if (count <= 0xffff) {
+		buffer.push_back(code);
+		packBig(buffer, count, 2);
+	}
+	else {
+		buffer.push_back(code + 1);
+		packBig(buffer, count, 4);
+	}
+}
+
+void Torpedo::packString(std::string &buffer, const char *text, unsigned int length) {
+	if (length < 32) {
+		buffer.push_back(0xa0 | length);
+	}
+	else if (length <= 0xff) {
+		buffer.push_back(0xd9);
+		buffer.push_back(length);
+	}
+	else {
+		packCount(buffer, length, 0, 0, 0xda);
+	}
+	buffer.append(text, length);
+}
+
+void Torpedo::packJson(std::string &buffer, json_t *value) {
+	switch (json_typeof(value)) {
+		case JSON_OBJECT: {
+			packCount(buffer, json_object_size(value), 0x80, 16, 0xde);
+			const char *key;
+			json_t *member;
+			json_object_foreach(value, key, member) {
+				packString(buffer, key, strlen(key));
+				packJson(buffer, member);
+			}
+			break;
+		}
+		case JSON_ARRAY: {
+			unsigned int size = json_array_size(value);
+			packCount(buffer, size, 0x90, 16, 0xdc);
+			for (unsigned int i = 0; i < size; i++)
+				packJson(buffer, json_array_get(value, i));
+			break;
+		}
+		case JSON_STRING:
+			packString(buffer, json_string_value(value), json_string_length(value));
+			break;
+		case JSON_INTEGER: {
+			long long n = json_integer_value(value);
+			if ((n >= -32) && (n <= 127)) {
+				buffer.push_back(n & 0xff);
+			}
+			else if ((n >= -128) && (n <= 127)) {
+				buffer.push_back(0xd0);
+				packBig(buffer, n, 1);
+			}
+			else if ((n >= -32768) && (n <= 32767)) {
+				buffer.push_back(0xd1);
+				packBig(buffer, n, 2);
+			}
+			else if ((n >= -2147483648LL) && (n <= 2147483647LL)) {
+				buffer.push_back(0xd2);
+				packBig(buffer, n, 4);
+			}
+			else {
+				buffer.push_back(0xd3);
+				packBig(buffer, n, 8);
+			}
+			break;
+		}
+		case JSON_REAL: {
+			double d = json_real_value(value);
+			float f = d;
+			if ((double)f == d) {
+				unsigned int bits;
+				memcpy(&bits, &f, 4);
+				buffer.push_back(0xca);
+				packBig(buffer, bits, 4);
+			}
+			else {
+				unsigned long long bits;
+				memcpy(&bits, &d, 8);
+				buffer.push_back(0xcb);
+				packBig(buffer, bits, 8);
+			}
+			break;
+		}
+		case JSON_TRUE:
+			buffer.push_back(0xc3);
+			break;
+		case JSON_FALSE:
+			buffer.push_back(0xc2);
+			break;
+		default:
+			buffer.push_back(0xc0);
+			break;
+	}
+}
+
+int Torpedo::unpackString(const std::string &buffer, unsigned int &index, std::string &text) {
+	if (index >= buffer.length())
+		return 0;
+	unsigned int code = (unsigned char)buffer[index++];
+	unsigned long long length;
+	if ((code & 0xe0) == 0xa0)
+		length = code & 0x1f;
+	else if ((code < 0xd9) || (code > 0xdb) || !readBig(buffer, index, 1 << (code - 0xd9), length))
+		return 0;
+	if (buffer.length() - index < length)
+		return 0;
+	text.assign(buffer, index, length);
+	index += length;
+	return 1;
+}
+
+static json_t *unpackValue(const std::string &buffer, unsigned int &index, unsigned int depth) {
+	if ((index >= buffer.length()) || (depth > maxPackDepth))
+		return NULL;
+	unsigned int code = (unsigned char)buffer[index];
+	unsigned long long n;
+	if (((code & 0xe0) == 0xa0) || ((code >= 0xd9) && (code <= 0xdb))) {
+		std::string text;
+		if (!Torpedo::unpackString(buffer, index, text))
+			return NULL;
+		return json_stringn(text.data(), text.length());
+	}
+	index++;
+	if ((code < 0x80) || (code >= 0xe0))
+		return json_integer((signed char)code);
+	unsigned int count = 0;
+	int isMap = 0;
+	if ((code & 0xf0) == 0x80) {
+		count = code & 0x0f;
+		isMap = 1;
+	}
+	else if ((code & 0xf0) == 0x90) {
+		count = code & 0x0f;
+	}
+	else if ((code >= 0xdc) && (code <= 0xdf)) {
+		if (!readBig(buffer, index, (code & 1)?4:2, n))
+			return NULL;
+		count = n;
+		isMap = (code >= 0xde);
+	}
+	else {
+		switch (code) {
+			case 0xc0:
+				return json_null();
+			case 0xc2:
+				return json_false();
+			case 0xc3:
+				return json_true();
+			case 0xca: {
+				if (!readBig(buffer, index, 4, n))
+					return NULL;
+				unsigned int bits = n;
+				float f;
+				memcpy(&f, &bits, 4);
+				return json_real(f);
+			}
+			case 0xcb: {
+				if (!readBig(buffer, index, 8, n))
+					return NULL;
+				double d;
+				memcpy(&d, &n, 8);
+				return json_real(d);
+			}
+			case 0xcc:
+			case 0xcd:
+			case 0xce:
+			case 0xcf:
+				if (!readBig(buffer, index, 1 << (code - 0xcc), n))
+					return NULL;
+				return json_integer(n);
+			case 0xd0:
+			case 0xd1:
+			case 0xd2:
+			case 0xd3: {
+				unsigned int bytes = 1 << (code - 0xd0);
+				if (!readBig(buffer, index, bytes, n))
+					return NULL;
+				// Sign extend
+				if ((bytes < 8) && (n >> (bytes * 8 - 1)))
+					n |= ~0ULL << (bytes * 8);
+				return json_integer((long long)n);
+			}
+		}
+		return NULL;
+	}
+	json_t *container = isMap?json_object():json_array();
+	std::string key;
+	for (unsigned int i = 0; i < count; i++) {
+		if (isMap && !Torpedo::unpackString(buffer, index, key))
+			break;
+		json_t *member = unpackValue(buffer, index, depth + 1);
+		if (!member)
+			break;
+		if (isMap)
+			json_object_set_new(container, key.c_str(), member);
+		else
+			json_array_append_new(container, member);
+		if (i + 1 == count)
+			return container;
+	}
+	if (!count)
+		return container;
+	json_decref(container);
+	return NULL;
+}
+
+json_t *Torpedo::unpackJson(const std::string &buffer, unsigned int &index) {
+	return unpackValue(buffer, index, 0);
+}
+
+//
+// The scanner only checks the structure as far as it needs to find the
+// end of each value. Anything it passes over is checked by jansson if it
+// is ever asked for.
+//
+
+static unsigned int skipSpace(const char *text, unsigned int index, unsigned int length) {
+	while ((index < length) && ((text[index] == ' ') || (text[index] == '\t') || (text[index] == '\n') || (text[index] == '\r')))
+		index++;
+	return index;
+}
+
+//
+// These return the index just past the value starting at index, or 0 if
+// there is none.
+//
+
+static unsigned int skipString(const char *text, unsigned int index, unsigned int length) {
+	index++;
+	while (index < length) {
+		if (text[index] == '\\')
+			index += 2;
+		else if (text[index] == '"')
+			return index + 1;
+		else
+			index++;
+	}
+	return 0;
+}
+
+static unsigned int skipValue(const char *text, unsigned int index, unsigned int length) {
+	if (index >= length)
+		return 0;
+	if (text[index] == '"')
+		return skipString(text, index, length);
+	if ((text[index] == '{') || (text[index] == '[')) {
+		unsigned int depth = 0;
+		while (index < length) {
+			char c = text[index];
+			if (c == '"') {
+				index = skipString(text, index, length);
+				if (!index)
+					return 0;
+				continue;
+			}
+			if ((c == '{') || (c == '['))
+				depth++;
+			else if (((c == '}') || (c == ']')) && !--depth)
+				return index + 1;
+			index++;
+		}
+		return 0;
+	}
+	unsigned int start = index;
+	while ((index < length) && !strchr(",}] \t\n\r", text[index]))
+		index++;
+	return (index > start)?index:0;
+}
+
+static unsigned int hexDigits(const char *text, unsigned int index) {
+	unsigned int value = 0;
+	for (unsigned int i = 0; i < 4; i++) {
+		char c = text[index + i];
+		value <<= 4;
+		if ((c >= '0') && (c <= '9'))
+			value |= c - '0';
+		else if ((c >= 'a') && (c <= 'f'))
+			value |= c - 'a' + 10;
+		else if ((c >= 'A') && (c <= 'F'))
+			value |= c - 'A' + 10;
+		else
+			return 0x110000;
+	}
+	return value;
+}
+
+static void appendUtf8(std::string &buffer, unsigned int code) {
+	if (code < 0x80) {
+		buffer.push_back(code);
+	}
+	else if (code < 0x800) {
+		buffer.push_back(0xc0 | (code >> 6));
+		buffer.push_back(0x80 | (code & 0x3f));
+	}
+	else if (code < 0x10000) {
+		buffer.push_back(0xe0 | (code >> 12));
+		buffer.push_back(0x80 | ((code >> 6) & 0x3f));
+		buffer.push_back(0x80 | (code & 0x3f));
+	}
+	else {
+		buffer.push_back(0xf0 | (code >> 18));
+		buffer.push_back(0x80 | ((code >> 12) & 0x3f));
+		buffer.push_back(0x80 | ((code >> 6) & 0x3f));
+		buffer.push_back(0x80 | (code & 0x3f));
+	}
+}
+
+int JsonScanner::scan(const char *text, unsigned int length) {
+	_text = text;
+	_length = length;
+	_fields.clear();
+	unsigned int index = skipSpace(text, 0, length);
+	if ((index >= length) || (text[index] != '{'))
+		return 0;
+	index = skipSpace(text, index + 1, length);
+	if ((index < length) && (text[index] == '}'))
+		return 1;
+	while (index < length) {
+		if (text[index] != '"')
+			return 0;
+		unsigned int end = skipString(text, index, length);
+		if (!end)
+			return 0;
+		Field field;
+		field._key = index + 1;
+		field._keyLength = end - index - 2;
+		index = skipSpace(text, end, length);
+		if ((index >= length) || (text[index] != ':'))
+			return 0;
+		index = skipSpace(text, index + 1, length);
+		end = skipValue(text, index, length);
+		if (!end)
+			return 0;
+		field._value = index;
+		field._valueLength = end - index;
+		_fields.push_back(field);
+		index = skipSpace(text, end, length);
+		if ((index < length) && (text[index] == '}'))
+			return 1;
+		if ((index >= length) || (text[index] != ','))
+			return 0;
+		index = skipSpace(text, index + 1, length);
+	}
+	return 0;
+}
+
+//
+// As in jansson, the last of any repeated keys wins.
+//
+
+const JsonScanner::Field *JsonScanner::find(const char *key) {
+	unsigned int length = strlen(key);
+	for (unsigned int i = _fields.size(); i--;) {
+		const Field &field = _fields[i];
+		if ((field._keyLength == length) && !memcmp(_text + field._key, key, length))
+			return &field;
+	}
+	return nullptr;
+}
+
+int JsonScanner::integer(const char *key, long long &value) {
+	const Field *field = find(key);
+	if (!field || (field->_valueLength > 20))
+		return 0;
+	char digits[21];
+	memcpy(digits, _text + field->_value, field->_valueLength);
+	digits[field->_valueLength] = 0;
+	char *end;
+	value = strtoll(digits, &end, 10);
+	return (end != digits) && !*end;
+}
+
+json_t *JsonScanner::json(const char *key) {
+	const Field *field = find(key);
+	if (!field)
+		return nullptr;
 	json_error_t error;
-	json_t *rootJ = json_loads(message.c_str(), 0, &error);
-	if (!rootJ) {
-		if (dbg) debug("Torpedo MESG Error: %s", error.text);
-		return;
-	} 
-	json_t *jp = json_object_get(rootJ, "plugin");
-	if (json_is_string(jp)) 
-		pluginName.assign(json_string_value(jp));
-	json_t *jm = json_object_get(rootJ, "module");
-	if (json_is_string(jm))
-		moduleName.assign(json_string_value(jm));
-	json_t *jt = json_object_get(rootJ, "patch");
-	if (jt)
-		received(pluginName, moduleName, jt);
+	return json_loadb(_text + field->_value, field->_valueLength, JSON_DECODE_ANY, &error);
+}
+
+int JsonScanner::string(const char *key, std::string &value) {
+	const Field *field = find(key);
+	if (!field || (_text[field->_value] != '"'))
+		return 0;
+	const char *text = _text + field->_value;
+	unsigned int end = field->_valueLength - 1;
+	value.clear();
+	for (unsigned int index = 1; index < end; index++) {
+		char c = text[index];
+		if (c != '\\') {
+			value.push_back(c);
+			continue;
+		}
+		// skipString() has made sure an escape is not the last character
+		c = text[++index];
+		switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				value.push_back(c);
+				break;
+			case 'b':
+				value.push_back('\b');
+				break;
+			case 'f':
+				value.push_back('\f');
+				break;
+			case 'n':
+				value.push_back('\n');
+				break;
+			case 'r':
+				value.push_back('\r');
+				break;
+			case 't':
+				value.push_back('\t');
+				break;
+			case 'u': {
+				if (index + 4 >= end) {
+					value.clear();
+					return 0;
+				}
+				unsigned int code = hexDigits(text, index + 1);
+				index += 4;
+				if ((code >= 0xd800) && (code < 0xdc00) && (index + 6 < end) && (text[index + 1] == '\\') && (text[index + 2] == 'u')) {
+					unsigned int low = hexDigits(text, index + 3);
+					if ((low >= 0xdc00) && (low < 0xe000)) {
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						index += 6;
+					}
+				}
+				if ((code > 0x10ffff) || ((code >= 0xd800) && (code < 0xe000))) {
+					value.clear();
+					return 0;
+				}
+				appendUtf8(value, code);
+				break;
+			}
+			default:
+				value.clear();
+				return 0;
+		}
+	}
+	return 1;
+}
+
+void Torpedo::messageEnvelope(std::string &buffer, unsigned int binary, const std::string &pluginName, const std::string &moduleName, const std::string &message) {
+	buffer.clear();
+	if (binary) {
+		buffer.push_back(0x93);
+		packString(buffer, pluginName.data(), pluginName.length());
+		packString(buffer, moduleName.data(), moduleName.length());
+		packString(buffer, message.data(), message.length());
+		return;
+	}
+	json_t *rootJ = json_object();
+	json_object_set_new(rootJ, "plugin", json_string(pluginName.c_str()));
+	json_object_set_new(rootJ, "module", json_string(moduleName.c_str()));
+	json_object_set_new(rootJ, "message", json_string(message.c_str()));
+	char *msg = json_dumps(rootJ, 0);
 	json_decref(rootJ);
+	buffer.assign(msg);
+	free(msg);
+}
+
+//
+// Snapshots only; rootJ still belongs to the caller.
+//
+
+void Torpedo::patchEnvelope(std::string &buffer, unsigned int binary, const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
+	buffer.clear();
+	if (binary) {
+		buffer.push_back(0x93);
+		packString(buffer, pluginName.data(), pluginName.length());
+		packString(buffer, moduleName.data(), moduleName.length());
+		packJson(buffer, rootJ);
+		return;
+	}
+	json_t *wrapper = json_object();
+	json_object_set_new(wrapper, "plugin", json_string(pluginName.c_str()));
+	json_object_set_new(wrapper, "module", json_string(moduleName.c_str()));
+	json_object_set(wrapper, "patch", rootJ);
+	char *msg = json_dumps(wrapper, 0);
+	json_decref(wrapper);
+	buffer.assign(msg);
+	free(msg);
+}
+
+void MessageOutputPort::send(const std::string &pluginName, const std::string &moduleName, const std::string &message) {
+	messageEnvelope(_packed, _binary, pluginName, moduleName, message);
+	sendEnvelope(pluginName, moduleName, _packed.data(), _packed.length());
+}
+
+void MessageInputPort::received(const std::string &appId, const std::string &message) {
+	if (dbg) debug("Torpedo Received: %s", message.c_str());
+	_pluginName.clear();
+	_moduleName.clear();
+	_text.clear();
+
+	if (!appId.compare("MESB")) {
+		unsigned int index = 1;
+		if (!message.length() || ((unsigned char)message[0] != 0x93)
+				|| !unpackString(message, index, _pluginName)
+				|| !unpackString(message, index, _moduleName)) {
+			if (dbg) debug("Torpedo MESB Error");
+			return;
+		}
+		if (!accept(_pluginName, _moduleName))
+			return;
+		if (!unpackString(message, index, _text)) {
+			if (dbg) debug("Torpedo MESB Error");
+			return;
+		}
+		received(_pluginName, _moduleName, _text);
+		return;
+	}
+	if (appId.compare("MESG"))
+		return;
+	if (!_scanner.scan(message.data(), message.length())) {
+		if (dbg) debug("Torpedo MESG Error");
+		return;
+	}
+	_scanner.string("plugin", _pluginName);
+	_scanner.string("module", _moduleName);
+	if (!accept(_pluginName, _moduleName))
+		return;
+	_scanner.string("message", _text);
+	received(_pluginName, _moduleName, _text);
+}
+
+PatchState::PatchState(const PatchState &other) {
+	_state = json_deep_copy(other._state);
+	_version = other._version;
+	_updates = other._updates;
+}
+
+PatchState::~PatchState() {
+	json_decref(_state);
+}
+
+PatchState &PatchState::operator=(const PatchState &other) {
+	if (this != &other) {
+		json_decref(_state);
+		_state = json_deep_copy(other._state);
+		_version = other._version;
+		_updates = other._updates;
+	}
+	return *this;
+}
+
+//
+// An update that never went out leaves the receiver behind, so the next
+// one for that plugin and module is sent whole.
+//
+
+void PatchOutputPort::dropped(unsigned int index) {
+	auto found = _states.find(_keys[index]);
+	if (found == _states.end())
+		return;
+	json_decref(found->second._state);
+	found->second._state = nullptr;
+}
+
+void PatchOutputPort::send(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
+	if (_delta && json_is_object(rootJ)) {
+		sendDelta(pluginName, moduleName, rootJ);
+		return;
+	}
+	patchEnvelope(_packed, _binary, pluginName, moduleName, rootJ);
+	json_decref(rootJ);
+	sendEnvelope(pluginName, moduleName, _packed.data(), _packed.length());
+}
+
+//
+// Send rootJ as a snapshot or as a delta from the last state sent. The
+// last state only moves on once the envelope has been accepted, so a
+// dropped update is folded into the next one.
+//
+
+void PatchOutputPort::sendDelta(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {
+	_stateKey.assign(pluginName);
+	_stateKey.push_back('\n');
+	_stateKey.append(moduleName);
+	auto found = _states.find(_stateKey);
+	if (found == _states.end()) {
+		if (_states.size() >= maxStates)
+			_states.erase(_states.begin());
+		found = _states.insert(std::make_pair(_stateKey, PatchState())).first;
+	}
+	PatchState &state = found->second;
+	int snapshot = !state._state || (state._updates + 1 >= _delta) || (_coalesce && isQueued(_stateKey));
+	json_t *changes = nullptr;
+	json_t *removed = nullptr;
+	if (!snapshot) {
+		const char *key;
+		json_t *value;
+		changes = json_object();
+		removed = json_array();
+		json_object_foreach(rootJ, key, value) {
+			json_t *old = json_object_get(state._state, key);
+			if (!old || !json_equal(old, value))
+				json_object_set(changes, key, value);
+		}
+		json_object_foreach(state._state, key, value) {
+			if (!json_object_get(rootJ, key))
+				json_array_append_new(removed, json_string(key));
+		}
+		if (!json_object_size(changes) && !json_array_size(removed)) {
+			json_decref(changes);
+			json_decref(removed);
+			json_decref(rootJ);
+			return;
+		}
+	}
+	unsigned int version = state._version + 1;
+	int sent;
+	if (_binary) {
+		_packed.clear();
+		_packed.push_back(snapshot?0x94:0x96);
+		packString(_packed, pluginName.data(), pluginName.length());
+		packString(_packed, moduleName.data(), moduleName.length());
+		packJson(_packed, snapshot?rootJ:changes);
+		json_t *number = json_integer(version);
+		packJson(_packed, number);
+		json_decref(number);
+		if (!snapshot) {
+			number = json_integer(state._version);
+			packJson(_packed, number);
+			json_decref(number);
+			packJson(_packed, removed);
+		}
+		sent = sendEnvelope(pluginName, moduleName, _packed.data(), _packed.length());
+	}
+	else {
+		json_t *wrapper = json_object();
+		json_object_set_new(wrapper, "plugin", json_string(pluginName.c_str()));
+		json_object_set_new(wrapper, "module", json_string(moduleName.c_str()));
+		json_object_set_new(wrapper, "version", json_integer(version));
+		if (snapshot) {
+			json_object_set(wrapper, "patch", rootJ);
+		}
+		else {
+			json_object_set_new(wrapper, "base", json_integer(state._version));
+			json_object_set(wrapper, "delta", changes);
+			if (json_array_size(removed))
+				json_object_set(wrapper, "removed", removed);
+		}
+		char *msg = json_dumps(wrapper, 0);
+		json_decref(wrapper);
+		sent = sendEnvelope(pluginName, moduleName, msg, strlen(msg));
+		free(msg);
+	}
+	if (changes) {
+		json_decref(changes);
+		json_decref(removed);
+	}
+	if (!sent) {
+		json_decref(rootJ);
+		return;
+	}
+	if (!snapshot && !state._state) {
+		// Room was made for this delta by replacing the update it follows
+		// on from, so send the whole state in its place
+		state._version = version;
+		sendDelta(pluginName, moduleName, rootJ);
+		return;
+	}
+	json_decref(state._state);
+	state._state = rootJ;
+	state._version = version;
+	state._updates = snapshot?0:(state._updates + 1);
+}
+
+//
+// Apply a snapshot or a delta to the state held for the current plugin
+// and module, and return the state to deliver, or NULL if the delta does
+// not follow on from it.
+//
+
+json_t *PatchInputPort::merge(json_t *patch, json_t *delta, json_t *removed, unsigned int version, unsigned int base) {
+	_stateKey.assign(_pluginName);
+	_stateKey.push_back('\n');
+	_stateKey.append(_moduleName);
+	auto found = _states.find(_stateKey);
+	if (json_is_object(patch)) {
+		if (found == _states.end()) {
+			if (_states.size() >= maxStates)
+				_states.erase(_states.begin());
+			found = _states.insert(std::make_pair(_stateKey, PatchState())).first;
+		}
+		json_decref(found->second._state);
+		found->second._state = json_incref(patch);
+		found->second._version = version;
+		return found->second._state;
+	}
+	if ((found == _states.end()) || (found->second._version != base) || !json_is_object(delta)) {
+		if (dbg) debug("Torpedo PTCH Stale: %u", base);
+		_stale++;
+		return NULL;
+	}
+	json_t *state = found->second._state;
+	const char *key;
+	json_t *value;
+	json_object_foreach(delta, key, value)
+		json_object_set(state, key, value);
+	for (unsigned int i = 0; i < json_array_size(removed); i++) {
+		json_t *jk = json_array_get(removed, i);
+		if (json_is_string(jk))
+			json_object_del(state, json_string_value(jk));
+	}
+	found->second._version = version;
+	return state;
+}
+
+void PatchInputPort::received(const std::string &appId, const std::string &message) {
+	if (dbg) debug("Torpedo Received: %s", message.c_str());
+	_pluginName.clear();
+	_moduleName.clear();
+
+	if (!appId.compare("PTCB")) {
+		unsigned int index = 1;
+		unsigned int code = message.length()?(unsigned char)message[0]:0;
+		if (((code != 0x93) && (code != 0x94) && (code != 0x96))
+				|| !unpackString(message, index, _pluginName)
+				|| !unpackString(message, index, _moduleName)) {
+			if (dbg) debug("Torpedo PTCB Error");
+			return;
+		}
+		if (!accept(_pluginName, _moduleName))
+			return;
+		json_t *values[4] = { NULL, NULL, NULL, NULL };
+		unsigned int count = (code & 0x0f) - 2;
+		unsigned int i;
+		for (i = 0; i < count; i++) {
+			values[i] = unpackJson(message, index);
+			if (!values[i])
+				break;
+		}
+		if (i == count) {
+			json_t *rootJ = values[0];
+			if (count == 2)
+				rootJ = merge(values[0], NULL, NULL, json_integer_value(values[1]), 0);
+			else if (count == 4)
+				rootJ = merge(NULL, values[0], values[3], json_integer_value(values[1]), json_integer_value(values[2]));
+			if (rootJ)
+				received(_pluginName, _moduleName, rootJ);
+		}
+		else if (dbg) {
+			debug("Torpedo PTCB Error");
+		}
+		for (i = 0; i < count; i++)
+			json_decref(values[i]);
+		return;
+	}
+	if (appId.compare("PTCH"))
+		return;
+	if (!_scanner.scan(message.data(), message.length())) {
+		if (dbg) debug("Torpedo PTCH Error");
+		return;
+	}
+	_scanner.string("plugin", _pluginName);
+	_scanner.string("module", _moduleName);
+	if (!accept(_pluginName, _moduleName))
+		return;
+	long long version;
+	if (!_scanner.integer("version", version)) {
+		json_t *jt = _scanner.json("patch");
+		if (jt) {
+			received(_pluginName, _moduleName, jt);
+			json_decref(jt);
+		}
+		return;
+	}
+	long long base = 0;
+	_scanner.integer("base", base);
+	json_t *patch = _scanner.json("patch");
+	json_t *delta = patch?NULL:_scanner.json("delta");
+	json_t *removed = patch?NULL:_scanner.json("removed");
+	json_t *jt = merge(patch, delta, removed, version, base);
+	if (jt)
+		received(_pluginName, _moduleName, jt);
+	json_decref(patch);
+	json_decref(delta);
+	json_decref(removed);
 }
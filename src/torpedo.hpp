@@ -1,6 +1,7 @@
 #pragma once
 #include "rack.hpp"
 #include "deque"
+#include "map"
 using namespace rack;
 
 namespace Torpedo {
@@ -14,14 +15,28 @@ namespace Torpedo {
 			STATE_HEADER,
 			STATE_BODY,
 			STATE_TRAILER,
-			STATE_ABORTING
+			STATE_ABORTING,
+			STATE_COMPACT_HEADER,
+			STATE_SKIPPING,		// Input only, ignoring the rest of a frame
+			STATE_CHECK		// Input only, expecting a check sample
 		};
 	
 		enum Errors {
 			ERROR_STATE,
 			ERROR_COUNTER,
 			ERROR_LENGTH,
-			ERROR_CHECKSUM
+			ERROR_CHECKSUM,
+			ERROR_SIZE
+		};
+
+		enum Flags {
+			FLAG_WIDE = 0x01,	// Body samples carry two bytes each
+			FLAG_BATCH = 0x02,	// Body is a series of length-prefixed messages
+			FLAG_SEGMENT = 0x04,	// Body is one segment of a message on a channel
+			FLAG_SEQUENCED = 0x08,	// Body is a numbered segment on a reliable link
+			FLAG_FEC = 0x10,	// Body is protected by forward error correction
+			FLAG_CHECKED = 0x20,	// Body has a check sample every _interval bytes
+			FLAG_COMPRESSED = 0x40	// Body is compressed, see compress()
 		};
 	
 		unsigned int _checksum = 0;
@@ -36,10 +51,13 @@ namespace Torpedo {
 			_portNum = portNum;	
 		}
 		void addCheckSum(unsigned int byte, unsigned int counter);
+		static void appendLength(std::string &buffer, unsigned int length);
+		static unsigned int check(unsigned int byte, unsigned int tag);
+		static int readLength(const std::string &buffer, unsigned int &index, unsigned int &length);
 		virtual int isBusy(void) {
 			return (_state != STATE_QUIESCENT);
 		}
-		void raiseError(unsigned int errorType);
+		virtual void raiseError(unsigned int errorType);
 		virtual void error(unsigned int errorType) {};
 		
 	};
@@ -47,12 +65,58 @@ namespace Torpedo {
 	//
 	// Raw output port functionality. Encapsulating layers 2-5 of the OSI model
 	//
+	// The whole frame is rendered into _frame when it is sent, and
+	// _state stays at STATE_HEADER until the last sample is output.
+	//
+	// With fec() set, the body is sent in groups of data samples, each
+	// followed by parity samples that let the receiver rebuild up to that
+	// many damaged samples in the group. Each of these samples carries one
+	// byte, with a check byte in place of the second.
+	//
+	// With checked() set, a check sample follows every that many body bytes,
+	// short of the end of the body. It carries the running checksum folded
+	// to 16 bits, so the receiver can give up on a damaged frame at once.
+	// Forward error correction takes precedence.
+	//
+	// With compress() set, bodies of at least minCompress bytes are sent
+	// compressed when that makes them shorter. The format is LZ77 with a
+	// preset dictionary of the strings that make up MESG and PTCH envelopes.
+	// Compressed frames always have the compact header, which receivers
+	// older than the flags byte reject as a state error. Streamed bodies are
+	// never compressed.
+	//
+	// sendStream() starts a frame whose body is not in memory. Only the
+	// header is rendered at first; the body is pulled from produce() a chunk
+	// at a time as the samples are needed. produce() should fill the buffer
+	// and return the number of bytes written. It is called again if it
+	// returns fewer, and returning 0 aborts the frame with ERROR_LENGTH.
+	// On a queued port, sendStream() is ignored unless the port is idle.
+	//
 
 	struct RawOutputPort : BasePort {
 		std::string _appId;
-		unsigned int _counter;
-		std::string _message;
+		std::vector<float> _frame;
+		unsigned int _position = 0;
 		Output *_port;
+		unsigned int _wide = 0;
+		unsigned int _compact = 0;
+		unsigned int _compress = 0;
+		unsigned int _compressing = 0;
+		std::string _compressed;
+		std::string _window;
+		std::vector<unsigned int> _hashes;
+		std::string _header;
+		std::string _chunk;
+		unsigned long long _clock = 0;
+		unsigned int _streamed = 0;
+		unsigned int _pending = 0;
+		unsigned int _fecData = 0;
+		unsigned int _fecParity = 0;
+		unsigned int _interval = 0;
+		unsigned int _bodyLength = 0;
+		static const unsigned int chunkSize = 256;
+		static const unsigned int maxParity = 16;
+		static const unsigned int minCompress = 32;
 
 		RawOutputPort(Module *module, unsigned int portNum) : BasePort(module, portNum) {
 			_port = &(_module->outputs[_portNum]);
@@ -60,29 +124,137 @@ namespace Torpedo {
 
 		virtual void abort();
 		virtual void appId(std::string app) { _appId.assign(app); }
+		void checked(unsigned int bytes) { _interval = bytes?(std::max(2u, std::min(bytes, 0xfffeu)) & ~1u):0; }
 		virtual void completed();
+		void compact(unsigned int c) { _compact = c; }
+		void compress(unsigned int c) { _compress = c; }
+		void fec(unsigned int data, unsigned int parity);
+		virtual unsigned int flags();
+		int isCompact() { return _compact || (flags() & (FLAG_BATCH | FLAG_SEGMENT | FLAG_SEQUENCED | FLAG_COMPRESSED)); }
+		virtual void next() {}
 		virtual void process();
-		virtual void send(std::string appId, std::string message);
-		virtual void send(std::string message);
+		void processBlock(float *samples, unsigned int count);
+		virtual unsigned int produce(char *bytes, unsigned int length) { return 0; }
+		void pull();
+		void render(const char *message, unsigned int length);
+		void renderBody(const char *bytes, unsigned int length, unsigned int start);
+		void renderBytes(unsigned int state, const char *bytes, unsigned int length, unsigned int pack, unsigned int start, unsigned int counter);
+		void renderHeader(unsigned int length);
+		void renderTrailer();
+		virtual void send(const std::string &appId, const std::string &message);
+		virtual void send(const std::string &message);
+		virtual void send(std::string &&message);
+		virtual void send(const char *message, unsigned int length);
+		void sendStream(const std::string &appId, unsigned int length);
+		virtual void sendStream(unsigned int length);
+		void shrink(const char *message, unsigned int length);
+		int start(unsigned int length);
+		void transmit(const char *message, unsigned int length);
+		void wide(unsigned int w) { _wide = w; }
 	};
 
 	//
 	// Raw input port functionality. Encapsulating layers 2-5 of the OSI model
 	//
+	// With stream() set, the body is handed to onChunk() in pieces of that
+	// many bytes as it arrives instead of being collected for received().
+	// onBegin() is called once the header is complete and onEnd() when the
+	// frame finishes; ok is zero if it failed or was cut short, and anything
+	// already passed to onChunk() should then be discarded. Batched and
+	// compressed frames are always collected and delivered to received(),
+	// compressed ones once expanded. In checked frames each chunk is the
+	// data between two check samples, passed on once it has been checked.
+	//
+	// Frames longer than maxSize(), or than maxMessageSize for the whole
+	// plugin, raise ERROR_SIZE as soon as the header is read and the rest
+	// of the frame is skipped. receiveBudget caps the bytes being assembled
+	// across all input ports at once. Ports are only processed on the
+	// engine thread, so the shared count is not locked. A port gives back
+	// its share when its input is unplugged or it is destroyed. Buffers
+	// that grew past keepSize for a larger message are freed once it is
+	// done with, so an idle port holds little more than that.
+	//
+	// After a framing error the port reports it and calls syncLost(), then
+	// stays silent until a frame arrives intact, when syncRegained() is
+	// called.
+	//
 	
 	struct RawInputPort : BasePort {
 		std::string _appId;
 		unsigned int _counter;
+		unsigned int _expect;
+		unsigned int _flags;
+		unsigned int _compact;
 		unsigned int _length;
+		unsigned int _received;
+		unsigned int _base = 0;
+		unsigned int _flush = 0;
+		unsigned int _stream = 0;
+		unsigned int _streaming = 0;
+		unsigned int _maxSize = 0;
+		unsigned int _held = 0;
+		unsigned int _inSync = 1;
+		unsigned int _fecData;
+		unsigned int _fecParity;
+		unsigned int _interval;
+		unsigned int _groupData = 0;
+		unsigned int _fill = 0;
+		unsigned int _repaired = 0;
+		unsigned char _group[256];
+		unsigned char _erased[256];
+		static unsigned int _reserved;
+		static unsigned int maxMessageSize;
+		static unsigned int receiveBudget;
+		static unsigned int keepSize;
 		std::string _message;
+		std::string _record;
+		std::string _expanded;
+		unsigned int _unbatching = 0;
+		std::vector<std::string> _pool;
+		static const unsigned int poolSize = 4;
 		Input *_port;
 
 		RawInputPort(Module *module, unsigned int portNum) : BasePort(module, portNum) { 
 			_port = &(_module->inputs[_portNum]);
+			_pool.reserve(poolSize);
 		}
+		virtual ~RawInputPort();
 
-		void process();
-		virtual void received(std::string appId, std::string message);
+		void advance();
+		int allowed(unsigned int length, unsigned int size);
+		void begin(unsigned int tag, unsigned int data);
+		void beginBody();
+		void body(unsigned int data);
+		void chunk();
+		void decode(float sample);
+		virtual void disconnect();
+		unsigned int decodeBody(const float *samples, unsigned int count);
+		void end(int ok);
+		int expand();
+		void fecSample(unsigned int data, unsigned int tag);
+		int header(unsigned int byte, unsigned int index);
+		void lost(unsigned int errorType);
+		void maxSize(unsigned int s) { _maxSize = s; }
+		virtual void onBegin(const std::string &appId, unsigned int length) {}
+		virtual void onChunk(const char *bytes, unsigned int length) {}
+		virtual void onEnd(int ok) {}
+		virtual void process();
+		void processBlock(const float *samples, unsigned int count);
+		void raiseError(unsigned int errorType) override;
+		virtual void received(const std::string &appId, const std::string &message);
+		void recycle(std::string &&buffer);
+		int repair();
+		unsigned int repaired() { return _repaired; }
+		void trim(std::string &buffer);
+		virtual void segment();
+		virtual void sequenced();
+		std::string take();
+		void store(unsigned int byte);
+		void stream(unsigned int s) { _stream = s; }
+		virtual void syncLost() {}
+		virtual void syncRegained() {}
+		void take(std::string &buffer);
+		void unbatch();
 	};
 
 	//
@@ -92,8 +264,8 @@ namespace Torpedo {
 	struct TextInputPort : RawInputPort {
 		TextInputPort(Module *module, unsigned int portNum) : RawInputPort(module, portNum) {}
 
-		void received(std::string appId, std::string message) override;
-		virtual void received(std::string message) {}
+		void received(const std::string &appId, const std::string &message) override;
+		virtual void received(const std::string &message) {}
 	};
 
 	struct TextOutputPort : RawOutputPort {
@@ -103,22 +275,319 @@ namespace Torpedo {
 	//
 	// Queued sending.
 	//
+	// Messages wait in a ring of _size reusable strings, so that once
+	// they have grown to fit, queueing does not allocate. An optional
+	// budget also limits the total bytes queued.
+	//
+	// sendKeyed() gives a message a coalescing key. If a message with the
+	// same key is still queued, the new one overwrites it in place, so only
+	// the latest state for each key is sent. With coalesce() set, the
+	// Message and Patch ports key their messages on plugin and module.
+	// sendKeyed() returns 0 if the message was dropped.
+	//
+	// With ttl() set, messages queued from then on expire if they have
+	// waited that many samples by the time they reach the head of the
+	// queue, and are dropped rather than sent.
+	//
+	// dropped() is called for each queued message thrown away unsent, by
+	// replace(), expiry, a smaller size() or abort(), while _keys still
+	// holds its key. The Message and Patch ports key every envelope they
+	// queue, but only coalesce them with coalesce() set.
+	//
 
 	struct QueuedOutputPort : RawOutputPort {
-		std::vector<std::string *> _queue;
+		std::vector<std::string> _queue;
+		std::vector<std::string> _keys;
+		std::vector<unsigned long long> _deadlines;
+		unsigned int _head = 0;
+		unsigned int _count = 0;
+		unsigned int _bytes = 0;
+		unsigned int _budget = 0;
 		unsigned int _replace = 0;
 		unsigned int _size = 0;
+		unsigned int _batch = 0;
+		unsigned int _batched = 0;
+		unsigned int _coalesce = 0;
+		unsigned int _coalesced = 0;
+		unsigned int _ttl = 0;
+		unsigned int _expired = 0;
+		std::string _batchBuffer;
+		std::string _keyBuffer;
 
 		QueuedOutputPort(Module *module, unsigned int portNum) : RawOutputPort(module, portNum) {}
-		virtual ~QueuedOutputPort() { for (auto i : _queue) delete i; }
 
 		void abort() override;
-		int isBusy() override { return (_state != STATE_QUIESCENT) || _queue.size(); }
-		virtual int isFul() { return _queue.size() >= _size; }
-		void process() override;
+		void batch(unsigned int bytes) { _batch = bytes; }
+		void budget(unsigned int bytes) { _budget = bytes; }
+		void coalesce(unsigned int c) { _coalesce = c; }
+		unsigned int coalesced() { return _coalesced; }
+		virtual void dropped(unsigned int index) {}
+		std::string *enqueue(unsigned int length);
+		unsigned int expired() { return _expired; }
+		int isExpired(unsigned int index) { return _deadlines[index] && (_clock > _deadlines[index]); }
+		int isQueued(const std::string &key);
+		unsigned int flags() override { return RawOutputPort::flags() | (_batched?FLAG_BATCH:0); }
+		int isBusy() override { return (_state != STATE_QUIESCENT) || _count; }
+		virtual int isFul() { return (_count >= _size) || (_budget && (_bytes >= _budget)); }
+		void next() override;
+		void pop();
+		int queue(const std::string &key, const char *message, unsigned int length);
+		unsigned int queued() { return _count; }
 		void replace(unsigned int rep) { _replace = rep; }
-		void send(std::string message) override;
+		void send(const std::string &message) override;
+		void send(std::string &&message) override;
+		void send(const char *message, unsigned int length) override;
+		void sendBatch();
+		int sendKeyed(const std::string &key, const std::string &message);
+		int sendEnvelope(const std::string &pluginName, const std::string &moduleName, const char *envelope, unsigned int length);
+		int sendKeyed(const std::string &key, const char *message, unsigned int length);
+		void sendStream(unsigned int length) override;
 		void size(unsigned int s);
+		void ttl(unsigned int samples) { _ttl = samples; }
+	};
+
+	//
+	// Multiplexed channels.
+	//
+	// Each channel has its own queue and priority. Messages are cut into
+	// segments of up to _segmentSize bytes, each sent as a frame of its own
+	// with FLAG_SEGMENT set, so a segment of an urgent message can go out
+	// between two segments of a long one. At every frame boundary the
+	// highest priority channel with something to send goes next, and
+	// channels of equal priority take turns.
+	//
+	// A segment body starts with the channel number and SEGMENT flags. The
+	// first segment of a message also carries its total length.
+	//
+	// A channel can carry MESG and PTCH envelopes, so that control messages
+	// overtake a long patch. The envelope forms of send() write them in the
+	// binary form when the channel's appId is MESB or PTCB. route() hands a
+	// channel's messages at the receiver to a MessageInputPort or
+	// PatchInputPort, which decodes them as if it had received them itself
+	// and need not be processed. Patches go whole, and queue coalescing,
+	// expiry and deltas are only done by the Message and Patch ports.
+	//
+
+	enum SegmentFlags {
+		SEGMENT_FIRST = 0x01,
+		SEGMENT_LAST = 0x02,
+		SEGMENT_RESET = 0x04	// Sender has restarted its sequence numbers
+	};
+
+	struct ChannelOutputPort : RawOutputPort {
+		struct Channel {
+			std::string _appId;
+			unsigned int _priority = 0;
+			unsigned int _size = 16;
+			unsigned int _offset = 0;
+			std::deque<std::string> _queue;
+		};
+
+		std::vector<Channel> _channels;
+		unsigned int _last = 0;
+		unsigned int _segmentSize = 256;
+		std::string _segment;
+		std::string _envelope;
+
+		ChannelOutputPort(Module *module, unsigned int portNum) : RawOutputPort(module, portNum) {}
+
+		void abort() override;
+		void channel(unsigned int c, const std::string &appId, unsigned int priority);
+		unsigned int flags() override { return RawOutputPort::flags() | FLAG_SEGMENT; }
+		int isBusy() override;
+		void next() override;
+		unsigned int queued(unsigned int c);
+		void segment(unsigned int bytes) { if (bytes) _segmentSize = bytes; }
+		void send(unsigned int c, const std::string &message);
+		void send(unsigned int c, std::string &&message);
+		void send(unsigned int c, const std::string &pluginName, const std::string &moduleName, const std::string &message);
+		void send(unsigned int c, const std::string &pluginName, const std::string &moduleName, json_t *rootJ);
+		void size(unsigned int c, unsigned int s);
+	};
+
+	struct ChannelInputPort : RawInputPort {
+		struct Channel {
+			std::string _appId;
+			std::string _message;
+			unsigned int _length = 0;
+			unsigned int _active = 0;
+			RawInputPort *_route = nullptr;
+		};
+
+		std::vector<Channel> _channels;
+
+		ChannelInputPort(Module *module, unsigned int portNum) : RawInputPort(module, portNum) {}
+		~ChannelInputPort();
+
+		void disconnect() override;
+		void discard(Channel &channel);
+		using RawInputPort::received;
+		virtual void received(unsigned int c, const std::string &appId, const std::string &message);
+		void route(unsigned int c, RawInputPort *port);
+		void segment() override;
+	};
+
+	//
+	// Reliable links.
+	//
+	// A reliable link needs a cable each way. Messages are cut into
+	// numbered segments, sent as frames with FLAG_SEQUENCED, and up to
+	// _windowSize of them may be unacknowledged at once. The receiver
+	// acknowledges every segment frame on the return cable with the next
+	// sequence number it expects and a bitmap of the segments it holds
+	// beyond that. The sender resends a segment when a later one is
+	// acknowledged before it, or when it has waited _timeout samples.
+	//
+	// A segment body starts with its sequence number and SEGMENT flags.
+	// The first segment of a message also carries its total length.
+	// Segments are marked SEGMENT_RESET and carry the sender's 16 bit
+	// epoch and the sequence number at the start of its window until the
+	// first acknowledgement arrives. Each sender, and each abort(), starts
+	// a new epoch, and a receiver resynchronises to that window whenever
+	// the epoch changes, so segments lost before it are still resent. Acknowledgements echo the epoch, so a sender
+	// ignores those meant for an earlier one. A receiver that joins part
+	// way through has not seen the epoch, and its acknowledgements are
+	// only taken once the sender is synchronised.
+	//
+	// Both ports process their return cable in process(), so they must be
+	// driven one sample at a time.
+	//
+
+	struct ReliableOutputPort : RawOutputPort {
+		struct AckInputPort : RawInputPort {
+			std::string _ack;
+			unsigned int _fresh = 0;
+			AckInputPort(Module *module, unsigned int portNum) : RawInputPort(module, portNum) {}
+			void received(const std::string &appId, const std::string &message) override;
+		};
+
+		struct Segment {
+			std::string _appId;
+			std::string _body;
+			unsigned long long _sent = 0;
+			unsigned int _acked = 0;
+			unsigned int _resend = 0;
+		};
+
+		AckInputPort _ackPort;
+		std::deque<std::string> _queue;
+		std::deque<Segment> _window;
+		unsigned int _size = 16;
+		unsigned int _offset = 0;
+		unsigned int _base = 0;
+		unsigned int _synced = 0;
+		unsigned int _windowSize = 8;
+		unsigned int _segmentSize = 64;
+		unsigned int _timeout = 1024;
+		unsigned int _retransmitted = 0;
+		unsigned int _epoch;
+		static unsigned int _epochs;
+		static const unsigned int maxWindow = 16;
+
+		ReliableOutputPort(Module *module, unsigned int portNum, unsigned int returnPortNum) : RawOutputPort(module, portNum), _ackPort(module, returnPortNum) {
+			_epoch = ++_epochs & 0xffff;
+		}
+
+		void abort() override;
+		void acknowledged(const std::string &ack);
+		unsigned int flags() override { return RawOutputPort::flags() | FLAG_SEQUENCED; }
+		int isBusy() override { return (_state != STATE_QUIESCENT) || _queue.size() || _window.size(); }
+		void next() override;
+		void process() override;
+		unsigned int queued() { return _queue.size(); }
+		unsigned int retransmitted() { return _retransmitted; }
+		void segment(unsigned int bytes) { if (bytes) _segmentSize = bytes; }
+		void send(const std::string &message) override;
+		void send(std::string &&message) override;
+		void send(const char *message, unsigned int length) override;
+		void size(unsigned int s) { if (s) _size = s; }
+		void timeout(unsigned int samples) { if (samples) _timeout = samples; }
+		void window(unsigned int w) { _windowSize = (w < maxWindow)?std::max(1u, w):maxWindow; }
+	};
+
+	struct ReliableInputPort : RawInputPort {
+		RawOutputPort _ackPort;
+		std::string _ack;
+		unsigned int _ackPending = 0;
+		unsigned int _expected = 0;
+		unsigned int _synced = 0;
+		unsigned int _epoch = noEpoch;
+		unsigned int _bitmap = 0;
+		static const unsigned int noEpoch = 0x10000;
+		std::string _slots[ReliableOutputPort::maxWindow];
+		std::string _slotIds[ReliableOutputPort::maxWindow];
+		std::string _assemblyId;
+		std::string _assembly;
+		unsigned int _assemblyLength = 0;
+		unsigned int _assembling = 0;
+
+		ReliableInputPort(Module *module, unsigned int portNum, unsigned int returnPortNum) : RawInputPort(module, portNum), _ackPort(module, returnPortNum) {}
+		~ReliableInputPort();
+
+		void assemble(const std::string &appId, const std::string &segment);
+		void disconnect() override;
+		void discard();
+		void process() override;
+		void sequenced() override;
+	};
+
+	//
+	// Binary envelopes.
+	//
+	// MESG and PTCH envelopes are JSON text by default. With binary() set,
+	// the Message and Patch ports send them as MessagePack instead, under
+	// the appIds MESB and PTCB: an array of the plugin name, the module
+	// name and the message or patch. Numbers are written fixed width, reals
+	// as 32 bit floats where that is exact, and strings length-prefixed.
+	// The input ports accept either form. Set binary() before anything is
+	// queued, as it changes the appId that queued envelopes go out under.
+	//
+	// packJson() and unpackJson() convert between jansson values and
+	// MessagePack directly, without going through text. unpackJson()
+	// returns NULL if the buffer is malformed or nested too deeply.
+	// messageEnvelope() and patchEnvelope() write a whole MESG or PTCH
+	// envelope into buffer, or its MESB or PTCB form if binary is set.
+	//
+
+	void messageEnvelope(std::string &buffer, unsigned int binary, const std::string &pluginName, const std::string &moduleName, const std::string &message);
+	void packJson(std::string &buffer, json_t *value);
+	void packString(std::string &buffer, const char *text, unsigned int length);
+	void patchEnvelope(std::string &buffer, unsigned int binary, const std::string &pluginName, const std::string &moduleName, json_t *rootJ);
+	json_t *unpackJson(const std::string &buffer, unsigned int &index);
+	int unpackString(const std::string &buffer, unsigned int &index, std::string &text);
+
+	//
+	// Lazy access to JSON envelopes.
+	//
+	// JsonScanner finds the top level keys of a JSON object in place,
+	// without building a tree or copying the text. Keys are matched as
+	// written, escapes and all. string() and integer() decode a single
+	// value, and json() parses just that value, of any type, with jansson
+	// on demand, returning a new reference or NULL. The text must outlive
+	// the scan.
+	//
+	// The Message and Patch input ports use it to read the plugin and
+	// module names first and pass them to accept(). If that returns 0 the
+	// rest of the envelope is never decoded, so rejecting messages meant
+	// for other modules is cheap.
+	//
+
+	struct JsonScanner {
+		struct Field {
+			unsigned int _key;
+			unsigned int _keyLength;
+			unsigned int _value;
+			unsigned int _valueLength;
+		};
+		const char *_text = nullptr;
+		unsigned int _length = 0;
+		std::vector<Field> _fields;
+
+		const Field *find(const char *key);
+		int integer(const char *key, long long &value);
+		json_t *json(const char *key);
+		int scan(const char *text, unsigned int length);
+		int string(const char *key, std::string &value);
 	};
 
 	//
@@ -126,33 +595,96 @@ namespace Torpedo {
 	//
 
 	struct MessageOutputPort : QueuedOutputPort {
+		unsigned int _binary = 0;
+		std::string _packed;
+
 		MessageOutputPort(Module *module, unsigned int portNum) : QueuedOutputPort(module, portNum) {_appId.assign("MESG");}
 
-		virtual void send(std::string pluginName, std::string moduleName, std::string message);
+		void binary(unsigned int b) { _binary = b; _appId.assign(b?"MESB":"MESG"); }
+		virtual void send(const std::string &pluginName, const std::string &moduleName, const std::string &message);
 	};
 
 	struct MessageInputPort : RawInputPort {
+		std::string _pluginName;
+		std::string _moduleName;
+		std::string _text;
+		JsonScanner _scanner;
+
 		MessageInputPort(Module *module, unsigned int portNum) : RawInputPort(module, portNum) {}
 
-		void received(std::string appId, std::string message) override;
-		virtual void received(std::string pluginName, std::string moduleName, std::string message) {}
+		virtual int accept(const std::string &pluginName, const std::string &moduleName) { return 1; }
+		void received(const std::string &appId, const std::string &message) override;
+		virtual void received(const std::string &pluginName, const std::string &moduleName, const std::string &message) {}
 	};
 
 	//
 	// Device Patches.
 	//
+	// With delta() set, the output port remembers the last state it sent
+	// for each plugin and module, and sends only the top level keys that
+	// have changed, with the version they apply to. Every that many
+	// updates, whenever coalescing would overwrite a queued update, and
+	// after an update was dropped from the queue unsent, it sends the whole
+	// state instead. A state that has not changed is not sent at all.
+	// Deltas are sent under the "delta" key, which older receivers ignore,
+	// and snapshots under "patch" as before.
+	//
+	// The input port keeps the latest state for up to maxStates plugin
+	// and module pairs, merges deltas into it and passes the merged state
+	// to received(). A delta that does not follow on from the version held
+	// is dropped and counted in stale(), and the state catches up at the
+	// next snapshot. The state passed to received() belongs to the port and
+	// must not be changed.
+	//
+	// A PatchState owns its JSON, and copying one copies the JSON, so the
+	// ports can be copied like any other.
+	//
+
+	struct PatchState {
+		json_t *_state = nullptr;
+		unsigned int _version = 0;
+		unsigned int _updates = 0;
+
+		PatchState() {}
+		PatchState(const PatchState &other);
+		~PatchState();
+
+		PatchState &operator=(const PatchState &other);
+	};
 
 	struct PatchOutputPort : QueuedOutputPort {
+		unsigned int _binary = 0;
+		unsigned int _delta = 0;
+		std::string _packed;
+		std::string _stateKey;
+		std::map<std::string, PatchState> _states;
+		static const unsigned int maxStates = 64;
+
 		PatchOutputPort(Module *module, unsigned int portNum) : QueuedOutputPort(module, portNum) {_appId.assign("PTCH");}
 
-		virtual void send(std::string pluginName, std::string moduleName, json_t *rootJ);
+		void binary(unsigned int b) { _binary = b; _appId.assign(b?"PTCB":"PTCH"); }
+		void delta(unsigned int snapshot) { _delta = snapshot; }
+		void dropped(unsigned int index) override;
+		virtual void send(const std::string &pluginName, const std::string &moduleName, json_t *rootJ);
+		void sendDelta(const std::string &pluginName, const std::string &moduleName, json_t *rootJ);
 	};
 
 	struct PatchInputPort : RawInputPort {
+		std::string _pluginName;
+		std::string _moduleName;
+		std::string _stateKey;
+		std::map<std::string, PatchState> _states;
+		unsigned int _stale = 0;
+		JsonScanner _scanner;
+		static const unsigned int maxStates = 64;
+
 		PatchInputPort(Module *module, unsigned int portNum) : RawInputPort(module, portNum) {}
 
-		void received(std::string appId, std::string message) override;
-		virtual void received(std::string pluginName, std::string moduleName, json_t *rootJ) {}
+		virtual int accept(const std::string &pluginName, const std::string &moduleName) { return 1; }
+		json_t *merge(json_t *patch, json_t *delta, json_t *removed, unsigned int version, unsigned int base);
+		void received(const std::string &appId, const std::string &message) override;
+		virtual void received(const std::string &pluginName, const std::string &moduleName, json_t *rootJ) {}
+		unsigned int stale() { return _stale; }
 	};
 		
 }